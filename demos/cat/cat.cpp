@@ -5,9 +5,15 @@
 #include <iostream>
 #include <memory>
 #include <chrono>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <filesystem>
+#include <stdexcept>
 #include "tty_context.hpp"
 #include "rasterizer.hpp"
 #include "texture.hpp"
+#include "presenter.hpp"
 
 using namespace rst;
 
@@ -29,6 +35,23 @@ struct MyVertexShader
 
         return OutType{outPos, in.tex, in.norm};
     }
+
+    // The same for PACKET_SIZE vertices at once
+    void operator()(const Packet<InType> &in, Packet<OutType> &out)
+    {
+        float *pos[4] = {out.Lanes(&OutType::pos, 0), out.Lanes(&OutType::pos, 1),
+                         out.Lanes(&OutType::pos, 2), out.Lanes(&OutType::pos, 3)};
+        TransformPoints(projection, in.Lanes(&InType::pos, 0), in.Lanes(&InType::pos, 1), in.Lanes(&InType::pos, 2),
+                        pos);
+        for (int k = 0; k < 2; ++k)
+        {
+            std::copy_n(in.Lanes(&InType::tex, k), PACKET_SIZE, out.Lanes(&OutType::tex, k));
+        }
+        for (int k = 0; k < 3; ++k)
+        {
+            std::copy_n(in.Lanes(&InType::norm, k), PACKET_SIZE, out.Lanes(&OutType::norm, k));
+        }
+    }
 };
 
 struct MyFragmentShader
@@ -40,6 +63,63 @@ struct MyFragmentShader
     Texture *tex;
 
     Vec4f operator()(const InType &in)
+    {
+        return Lighting(in) * tex->Fetch(in.tex);
+    }
+
+    // the derivatives select the mip level, far away fur samples a prefiltered texture
+    Vec4f operator()(const InType &in, const InType &ddx, const InType &ddy)
+    {
+        return Lighting(in) * tex->Sample(in.tex, ddx.tex, ddy.tex);
+    }
+
+    // Two quads: the lighting runs across the lanes, the texture is sampled for the covered ones only
+    void operator()(const Packet<InType> &in, unsigned mask, Packet<Vec4f> &color)
+    {
+        const float *px = in.Lanes(&InType::pos, 0), *py = in.Lanes(&InType::pos, 1);
+        const float *pz = in.Lanes(&InType::pos, 2), *pw = in.Lanes(&InType::pos, 3);
+        const float *nx = in.Lanes(&InType::norm, 0), *ny = in.Lanes(&InType::norm, 1);
+        const float *nz = in.Lanes(&InType::norm, 2);
+        Vec3f light = Normalize(Vec3f{1.f, 1.f, 3.f});
+
+        // Lighting() unrolled over the lanes
+        float lighting[PACKET_SIZE];
+        for (std::size_t lane = 0; lane < PACKET_SIZE; ++lane)
+        {
+            float cx = camPos.x - px[lane] / pw[lane];
+            float cy = camPos.y - py[lane] / pw[lane];
+            float cz = camPos.z - pz[lane] / pw[lane];
+            float invCamera = 1.f / std::sqrt(cx * cx + cy * cy + cz * cz);
+            float hx = light.x + cx * invCamera;
+            float hy = light.y + cy * invCamera;
+            float hz = light.z + cz * invCamera;
+            float invHalfway = 1.f / std::sqrt(hx * hx + hy * hy + hz * hz);
+            float NH = std::max(0.f, (nx[lane] * hx + ny[lane] * hy + nz[lane] * hz) * invHalfway);
+            float spec = NH * NH;
+            spec *= spec;
+            spec *= spec;
+            float diff = std::max(0.f, nx[lane] * light.x + ny[lane] * light.y + nz[lane] * light.z);
+            lighting[lane] = 0.2f + 0.4f * diff + 0.4f * spec;
+        }
+
+        const float *u = in.Lanes(&InType::tex, 0);
+        const float *v = in.Lanes(&InType::tex, 1);
+        float dudx[PACKET_SIZE], dudy[PACKET_SIZE], dvdx[PACKET_SIZE], dvdy[PACKET_SIZE];
+        QuadDerivatives(u, dudx, dudy);
+        QuadDerivatives(v, dvdx, dvdy);
+        for (; mask != 0; mask &= mask - 1)
+        {
+            int lane = __builtin_ctz(mask);
+            Vec4f texel = lighting[lane] * tex->Sample(Vec2f{u[lane], v[lane]}, Vec2f{dudx[lane], dvdx[lane]},
+                                                       Vec2f{dudy[lane], dvdy[lane]});
+            for (int k = 0; k < 4; ++k)
+            {
+                color[k][lane] = texel[k];
+            }
+        }
+    }
+
+    float Lighting(const InType &in)
     {
         Vec3f light = Normalize(Vec3f{1.f, 1.f, 3.f});
         Vec3f camera = Normalize(camPos - Vec3f{in.pos});
@@ -49,34 +129,77 @@ struct MyFragmentShader
         for(int i = 0; i < 3; i++)
             spec *= spec;
         float diff = std::max(0.f, Dot(in.norm, light));
-        Vec4f c = (0.2f + 0.4f * diff + 0.4f * spec) * tex->Fetch(in.tex);
-        return c;
+        return 0.2f + 0.4f * diff + 0.4f * spec;
     }
 };
 
-int main()
+// Parses cat.obj and writes the binary cache cat.mesh
+void BuildCache()
 {
-    Mat4f perspProj = Persp(1.0f, ASPECT_RATIO, 0.1f, 10.0f);
+    Mesh obj = Mesh::LoadFromObj("cat.obj");
+    // frame times go to stdout for stats.py, so report the mesh on stderr
+    std::cerr << "cat.obj: " << obj.stats.corners << " corners -> " << obj.vertices.size() << " vertices, "
+              << obj.meshlets.size() << " meshlets, ACMR "
+              << obj.stats.acmrBefore << " -> " << obj.stats.acmrAfter << std::endl;
+    obj.SaveBinary("cat.mesh");
+}
+
+// Parses the OBJ only once, later runs map the cache. The cache is rebuilt when it is missing,
+// older than cat.obj or not readable by this build, e.g. written with another format version.
+std::unique_ptr<MappedMesh> LoadCat()
+{
+    namespace fs = std::filesystem;
+    std::error_code error;
+    auto cacheTime = fs::last_write_time("cat.mesh", error);
+    bool stale = error || (fs::exists("cat.obj", error) && fs::last_write_time("cat.obj", error) > cacheTime);
+    if (!stale)
+    {
+        try
+        {
+            return std::make_unique<MappedMesh>("cat.mesh");
+        }
+        catch (const std::runtime_error &e)
+        {
+            std::cerr << e.what() << ", rebuilding it" << std::endl;
+        }
+    }
+
+    BuildCache();
+    return std::make_unique<MappedMesh>("cat.mesh");
+}
+
+// cat [presenter [frames [WIDTHxHEIGHT]]], e.g. "cat headless 100" or "cat ppm:frames/cat 10 1280x720".
+// The resolution defaults to the one of the framebuffer, smaller frames are scaled up when presented.
+int main(int argc, char **argv)
+{
+    auto presenter = MakePresenter(argc > 1 ? argv[1] : "fbdev");
+    int width = 0;
+    int height = 0;
+    auto context = argc > 3 && std::sscanf(argv[3], "%dx%d", &width, &height) == 2
+                 ? std::make_unique<TtyContext>(std::move(presenter), width, height)
+                 : std::make_unique<TtyContext>(std::move(presenter));
+
+    Mat4f perspProj = Persp(1.0f, context->GetViewport().GetAspectRatio(), 0.1f, 10.0f);
     Vec3f up(0.f, 1.f, 0.f);
     Vec3f at(0.f, 1.f, 0.f);
 
-    TtyContext context;
-
     MyVertexShader vs;
     MyFragmentShader fs;
-    Rasterizer<MyVertexShader, MyFragmentShader> pipe{context, vs, fs, 4};
+    Rasterizer<MyVertexShader, MyFragmentShader> pipe{*context, vs, fs, 4};
+    // the fragment shader is expensive, shade each visible pixel once
+    pipe.SetShadingMode(ShadingMode::Deferred);
 
-    Mesh cat = Mesh::LoadFromObj("cat.obj");
+    auto cat = LoadCat();
     Texture tex{"cat.ppm"};
     fs.tex = &tex;
 
     float theta = 0.4f;
     int iter = 0;
-    int iters = 2000;
+    int iters = argc > 2 ? std::atoi(argv[2]) : 2000;
 
     while (iter < iters)
     {
-        context.Clear();
+        context->Clear();
 
         float phi = 2.f / iters * M_PI * iter++;
         Vec3f dir(std::sin(phi) * std::cos(theta), std::sin(theta), std::cos(phi) * std::cos(theta));
@@ -88,12 +211,12 @@ int main()
 
         auto t0 = std::chrono::system_clock::now();
 
-        pipe.RasterizeVertexArray(cat.vertices, cat.indices);
+        pipe.RasterizeMesh(*cat);
 
         auto t1 = std::chrono::system_clock::now();
         std::chrono::duration<double, std::milli> const dt = t1 - t0;
         std::cout << dt.count() << std::endl;
-        context.FlushFb();
+        context->FlushFb();
     }
 
     return 0;
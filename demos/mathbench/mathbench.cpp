@@ -0,0 +1,170 @@
+//
+// Times the SSE overloads of math.hpp against the generic templates they replace.
+//
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <string>
+#include <cstdlib>
+#include "math.hpp"
+
+using namespace rst;
+
+namespace
+{
+
+constexpr std::size_t COUNT{1024};
+
+#ifdef __SSE2__
+// Candidates left out of math.hpp, kept here to show why
+float SseDot(const Vec4f &lhs, const Vec4f &rhs) noexcept
+{
+    return _mm_cvtss_f32(SumLanes(_mm_mul_ps(ToSse(lhs), ToSse(rhs))));
+}
+
+Vec3f SseCross(const Vec3f &lhs, const Vec3f &rhs) noexcept
+{
+    __m128 a = _mm_setr_ps(lhs.x, lhs.y, lhs.z, 0.f);
+    __m128 b = _mm_setr_ps(rhs.x, rhs.y, rhs.z, 0.f);
+    __m128 aYzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bYzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, bYzx), _mm_mul_ps(aYzx, b));
+    c = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+
+    alignas(16) float result[4];
+    _mm_store_ps(result, c);
+    return Vec3f{result[0], result[1], result[2]};
+}
+#endif
+
+template<typename T>
+std::vector<T> RandomItems(std::mt19937 &random)
+{
+    std::uniform_real_distribution<float> value{-1.f, 1.f};
+    std::vector<T> items(COUNT);
+    for (auto &item : items)
+    {
+        auto f = reinterpret_cast<float *>(&item);
+        for (std::size_t j = 0; j < sizeof(T) / sizeof(float); ++j)
+        {
+            f[j] = value(random);
+        }
+    }
+    return items;
+}
+
+template<typename Clock>
+double NsPerCall(typename Clock::time_point t0, int rounds)
+{
+    std::chrono::duration<double, std::nano> dt = Clock::now() - t0;
+    return dt.count() / (static_cast<double>(rounds) * COUNT);
+}
+
+// Independent calls: op(i) for every item, the compiler may vectorize across the items
+template<typename R, typename Op>
+double Throughput(int rounds, Op op)
+{
+    std::vector<R> out(COUNT);
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (std::size_t i = 0; i < COUNT; ++i)
+        {
+            out[i] = op(i);
+        }
+        asm volatile("" : : "r"(out.data()) : "memory");
+    }
+    return NsPerCall<std::chrono::steady_clock>(t0, rounds);
+}
+
+// Dependent calls: x = op(x, i), as in a chain of shader arithmetic
+template<typename R, typename Op>
+double Latency(int rounds, R x, Op op)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (std::size_t i = 0; i < COUNT; ++i)
+        {
+            x = op(x, i);
+        }
+    }
+    asm volatile("" : : "r"(&x) : "memory");
+    return NsPerCall<std::chrono::steady_clock>(t0, rounds);
+}
+
+void Report(const std::string &name, double generic, double simd)
+{
+    std::cout << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << generic << std::setw(10) << simd << std::setw(9) << generic / simd << "x"
+              << std::endl;
+}
+
+}
+
+// mathbench [rounds]
+int main(int argc, char **argv)
+{
+#ifndef __SSE2__
+    std::cerr << "built without SSE2, math.hpp has no overloads to compare" << std::endl;
+    return 1;
+#else
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 10000;
+    std::mt19937 random{42};
+    auto a = RandomItems<Vec4f>(random);
+    auto b = RandomItems<Vec4f>(random);
+    auto a3 = RandomItems<Vec3f>(random);
+    auto b3 = RandomItems<Vec3f>(random);
+    auto m = RandomItems<Mat4f>(random);
+    // a contraction keeps the chains from overflowing
+    Mat4f small = m[0];
+    for (auto &row : small.data)
+    {
+        for (auto &x : row)
+        {
+            x *= 0.125f;
+        }
+    }
+
+    std::cout << std::left << std::setw(24) << "ns per call" << std::right << std::setw(10) << "generic"
+              << std::setw(10) << "sse" << std::setw(10) << "speedup" << std::endl;
+    Report("Vec4f +",
+           Throughput<Vec4f>(rounds, [&](std::size_t i) { return operator+<float, 4>(a[i], b[i]); }),
+           Throughput<Vec4f>(rounds, [&](std::size_t i) { return a[i] + b[i]; }));
+    Report("Vec4f + (chain)",
+           Latency(rounds, a[0], [&](Vec4f x, std::size_t i) { return 0.5f * operator+<float, 4>(x, b[i]); }),
+           Latency(rounds, a[0], [&](Vec4f x, std::size_t i) { return 0.5f * (x + b[i]); }));
+    Report("Vec4f *",
+           Throughput<Vec4f>(rounds, [&](std::size_t i) { return operator*<float, 4>(a[i], b[i]); }),
+           Throughput<Vec4f>(rounds, [&](std::size_t i) { return a[i] * b[i]; }));
+    Report("Vec4f * (chain)",
+           Latency(rounds, a[0], [&](Vec4f x, std::size_t i) { return operator*<float, 4>(x, b[i]); }),
+           Latency(rounds, a[0], [&](Vec4f x, std::size_t i) { return x * b[i]; }));
+    Report("Normalize",
+           Throughput<Vec4f>(rounds, [&](std::size_t i) { return Normalize<float, 4>(a[i]); }),
+           Throughput<Vec4f>(rounds, [&](std::size_t i) { return Normalize(a[i]); }));
+    Report("Normalize (chain)",
+           Latency(rounds, a[0], [&](Vec4f x, std::size_t i) { return Normalize<float, 4>(x + b[i]); }),
+           Latency(rounds, a[0], [&](Vec4f x, std::size_t i) { return Normalize(x + b[i]); }));
+    Report("Mat4f * Vec4f",
+           Throughput<Vec4f>(rounds, [&](std::size_t i) { return operator*<float, 4>(m[i], a[i]); }),
+           Throughput<Vec4f>(rounds, [&](std::size_t i) { return m[i] * a[i]; }));
+    Report("Mat4f * Vec4f (chain)",
+           Latency(rounds, a[0], [&](Vec4f x, std::size_t i) { return operator*<float, 4>(small, x) + a[i]; }),
+           Latency(rounds, a[0], [&](Vec4f x, std::size_t i) { return small * x + a[i]; }));
+    Report("Mat4f * Mat4f",
+           Throughput<Mat4f>(rounds / 4, [&](std::size_t i) { return operator*<float, 4>(m[i], m[COUNT - 1 - i]); }),
+           Throughput<Mat4f>(rounds / 4, [&](std::size_t i) { return m[i] * m[COUNT - 1 - i]; }));
+    Report("Dot, not specialised",
+           Throughput<float>(rounds, [&](std::size_t i) { return Dot(a[i], b[i]); }),
+           Throughput<float>(rounds, [&](std::size_t i) { return SseDot(a[i], b[i]); }));
+    Report("Cross, not specialised",
+           Throughput<Vec3f>(rounds, [&](std::size_t i) { return Cross(a3[i], b3[i]); }),
+           Throughput<Vec3f>(rounds, [&](std::size_t i) { return SseCross(a3[i], b3[i]); }));
+
+    return 0;
+#endif
+}
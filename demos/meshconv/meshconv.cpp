@@ -0,0 +1,33 @@
+//
+// Converts an OBJ file into the binary mesh cache loaded by MappedMesh.
+//
+
+#include <iostream>
+#include "mesh.hpp"
+
+using namespace rst;
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "usage: " << argv[0] << " input.obj output.mesh" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        Mesh mesh = Mesh::LoadFromObj(argv[1]);
+        mesh.SaveBinary(argv[2]);
+        std::cout << argv[2] << ": " << mesh.vertices.size() << " vertices, " << mesh.indices.size() / 3
+                  << " triangles, " << mesh.meshlets.size() << " meshlets, ACMR " << mesh.stats.acmrBefore << " -> "
+                  << mesh.stats.acmrAfter << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
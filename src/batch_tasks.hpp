@@ -7,8 +7,16 @@
 
 #include "thread_pool.hpp"
 #include "tty_context.hpp"
+#include "raster_kernel.hpp"
+#include "mesh.hpp"
+#include "packet.hpp"
 #include <vector>
-#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <utility>
 
 namespace rst
 {
@@ -47,6 +55,304 @@ enum class Culling
     None
 };
 
+enum class ShadingMode
+{
+    Forward,  // shade every fragment still visible once its tile is rasterized
+    Deferred  // rasterize into a visibility buffer, then shade each visible pixel exactly once
+};
+
+// Fragment shaders may take the screen-space derivatives of their input as well:
+// Vec4f operator()(const InType &in, const InType &ddx, const InType &ddy)
+template<typename FShader, typename = void>
+struct HasDerivatives : std::false_type {};
+
+template<typename FShader>
+struct HasDerivatives<FShader, std::void_t<decltype(std::declval<FShader &>()(
+    std::declval<const typename FShader::InType &>(), std::declval<const typename FShader::InType &>(),
+    std::declval<const typename FShader::InType &>()))>> : std::true_type {};
+
+// Vertex shaders may shade PACKET_SIZE vertices per call as well:
+// void operator()(const Packet<InType> &in, Packet<OutType> &out)
+template<typename VShader, typename = void>
+struct HasPacketShader : std::false_type {};
+
+template<typename VShader>
+struct HasPacketShader<VShader, std::void_t<decltype(std::declval<VShader &>()(
+    std::declval<const Packet<typename VShader::InType> &>(),
+    std::declval<Packet<typename VShader::OutType> &>()))>> : std::true_type {};
+
+// Fragment shaders may shade a packet of two 2x2 quads per call:
+// void operator()(const Packet<InType> &in, unsigned mask, Packet<Vec4f> &color)
+// Only the lanes set in mask are written. The others are still interpolated, so QuadDerivatives
+// works on any lane value, but the shader may skip the expensive per-lane work there.
+template<typename FShader, typename = void>
+struct HasPacketFragmentShader : std::false_type {};
+
+template<typename FShader>
+struct HasPacketFragmentShader<FShader, std::void_t<decltype(std::declval<FShader &>()(
+    std::declval<const Packet<typename FShader::InType> &>(), std::declval<unsigned>(),
+    std::declval<Packet<Vec4f> &>()))>>
+    : std::true_type {};
+
+// Shades count vertices, vertices[indices[i]] if there are indices, into output[i]
+template<typename VShader>
+inline void ShadeVertices(VShader &shader, const typename VShader::InType *vertices, const unsigned *indices,
+                          std::size_t count, typename VShader::OutType *output)
+{
+    if constexpr (HasPacketShader<VShader>::value)
+    {
+        Packet<typename VShader::InType> in;
+        Packet<typename VShader::OutType> out;
+        for (std::size_t i = 0; i < count; i += PACKET_SIZE)
+        {
+            auto lanes = std::min(PACKET_SIZE, count - i);
+            if (indices)
+            {
+                in.Load(vertices, indices + i, lanes);
+            }
+            else
+            {
+                in.Load(vertices + i, lanes);
+            }
+            shader(in, out);
+            out.Store(output + i, lanes);
+        }
+    }
+    else
+    {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            output[i] = shader(vertices[indices ? indices[i] : i]);
+        }
+    }
+}
+
+// Render target layout shared by the binning and the tile stage, refreshed for every draw
+struct TileGrid
+{
+    int      width;
+    int      height;
+    int      tilesX;
+    int      tilesY;
+    Viewport viewport;
+};
+
+// Clip-space planes, a point is inside when its ClipDistance is not negative. Visible points have w < 0
+// (Persp stores the view-space z in w), so the near plane is z <= -w and the far one z >= w.
+// The side planes are scaled by band: 1 for the view frustum, GUARD_BAND for the guard band.
+enum ClipPlane
+{
+    CLIP_NEAR,
+    CLIP_FAR,
+    CLIP_LEFT,
+    CLIP_RIGHT,
+    CLIP_BOTTOM,
+    CLIP_TOP,
+    CLIP_PLANES
+};
+
+// Triangles within GUARD_BAND times the viewport are rasterized without clipping
+constexpr float GUARD_BAND{8.f};
+
+inline float ClipDistance(const Vec4f &p, int plane, float band) noexcept
+{
+    switch (plane)
+    {
+    case CLIP_NEAR:   return -(p.z + p.w);
+    case CLIP_FAR:    return p.z - p.w;
+    case CLIP_LEFT:   return -band * p.w - p.x;
+    case CLIP_RIGHT:  return p.x - band * p.w;
+    case CLIP_BOTTOM: return -band * p.w - p.y;
+    default:          return p.y - band * p.w;
+    }
+}
+
+inline unsigned OutCodes(const Vec4f &p, float band) noexcept
+{
+    unsigned codes = 0;
+    for (int plane = 0; plane < CLIP_PLANES; ++plane)
+    {
+        if (ClipDistance(p, plane, band) < 0.f)
+        {
+            codes |= 1u << plane;
+        }
+    }
+    return codes;
+}
+
+// Vertex shaders may expose the matrix taking their input positions to clip space as
+// Mat4f projection, which lets the rasterizer cull whole draws by their bounds
+template<typename VShader, typename = void>
+struct HasProjection : std::false_type {};
+
+template<typename VShader>
+struct HasProjection<VShader, std::enable_if_t<std::is_convertible_v<
+    decltype(std::declval<const VShader &>().projection), Mat4f>>> : std::true_type {};
+
+// True if the box is entirely outside one of the planes of the view frustum
+inline bool OutsideFrustum(const Aabb &bounds, const Mat4f &projection) noexcept
+{
+    unsigned outside = ~0u;
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        Vec4f pos{corner & 1 ? bounds.max.x : bounds.min.x,
+                  corner & 2 ? bounds.max.y : bounds.min.y,
+                  corner & 4 ? bounds.max.z : bounds.min.z, 1.f};
+        outside &= OutCodes(projection * pos, 1.f);
+    }
+    return outside != 0;
+}
+
+// Frustum and backface tests of meshlet bounds, set up once per draw from the matrix taking the
+// mesh to clip space
+class MeshletCuller
+{
+public:
+    MeshletCuller(const Mat4f &projection, Culling culling) noexcept;
+    bool Visible(const Mesh::Meshlet &meshlet) const noexcept;
+private:
+    Vec4f m_planes[CLIP_PLANES]; // in object space, normalized
+    Vec3f m_camera;              // in object space
+    float m_coneSign;            // 1 if back faces are culled, -1 for front faces, 0 for no cone test
+};
+
+inline MeshletCuller::MeshletCuller(const Mat4f &projection, Culling culling) noexcept:
+    m_coneSign{culling == Culling::Ccw ? 1.f : (culling == Culling::Cw ? -1.f : 0.f)}
+{
+    // the clip distances are linear in clip space, hence linear in object space too
+    for (int plane = 0; plane < CLIP_PLANES; ++plane)
+    {
+        Vec4f &p = m_planes[plane];
+        for (int j = 0; j < 4; ++j)
+        {
+            Vec4f axis;
+            axis[j] = 1.f;
+            float a = ClipDistance(axis, plane, 1.f);
+            for (int i = 0; i < 4; ++i)
+            {
+                p[i] += a * projection[j][i];
+            }
+        }
+        float length = Magnitude(Vec3f{p.x, p.y, p.z});
+        if (length > 0.f)
+        {
+            p = p / length;
+        }
+    }
+
+    // the eye is the point projected to x = y = w = 0; there is none for a parallel projection
+    const float *r[3] = {projection[0], projection[1], projection[3]};
+    auto det3 = [](const Vec3f &a, const Vec3f &b, const Vec3f &c) { return Dot(a, Cross(b, c)); };
+    Vec3f c0{r[0][0], r[1][0], r[2][0]};
+    Vec3f c1{r[0][1], r[1][1], r[2][1]};
+    Vec3f c2{r[0][2], r[1][2], r[2][2]};
+    Vec3f rhs{-r[0][3], -r[1][3], -r[2][3]};
+    float det = det3(c0, c1, c2);
+    if (det == 0.f)
+    {
+        m_coneSign = 0.f;
+        return;
+    }
+    m_camera = Vec3f{det3(rhs, c1, c2), det3(c0, rhs, c2), det3(c0, c1, rhs)} / det;
+}
+
+inline bool MeshletCuller::Visible(const Mesh::Meshlet &meshlet) const noexcept
+{
+    for (auto &plane : m_planes)
+    {
+        if (Dot(Vec3f{plane.x, plane.y, plane.z}, meshlet.center) + plane.w < -meshlet.radius)
+        {
+            return false;
+        }
+    }
+
+    // every face is seen from behind from anywhere in the bounding sphere
+    Vec3f view = meshlet.center - m_camera;
+    return m_coneSign == 0.f ||
+           m_coneSign * Dot(view, meshlet.coneAxis) < meshlet.coneCutoff * Magnitude(view) + meshlet.radius;
+}
+
+// The edge function coefficients are differences of snapped coordinates. Within the guard band these are
+// at most GUARD_BAND * MAX_TARGET_SIZE pixels apart, which bounds the steps across a block of the kernels.
+static_assert(2.0 * (RASTER_BLOCK_SIZE - 1) * GUARD_BAND * MAX_TARGET_SIZE * (1 << SUBPIXEL_BITS) < EDGE_LIMIT,
+              "the edge functions must step in 32 bits within a raster block");
+
+// Snaps the triangle given in NDC to the sub-pixel grid and sets up its edge functions, see RasterSetup,
+// and the bounding box of the pixel centers it may cover, clamped to the viewport. False if the triangle
+// is degenerate or culled after snapping, or covers no pixel center.
+
+inline bool SetupTriangle(const Vec3f v[3], const Viewport &viewport, Culling culling,
+                          RasterSetup &setup, int &minX, int &minY, int &maxX, int &maxY) noexcept
+{
+    constexpr std::int64_t one = 1 << SUBPIXEL_BITS;
+    std::int64_t x[3];
+    std::int64_t y[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        x[i] = std::llround(viewport.XNdcToPixel(v[i].x) * one);
+        y[i] = std::llround(viewport.YNdcToPixel(v[i].y) * one);
+    }
+
+    // Determine the winding of the triangle, NDC and pixels have the same orientation
+    std::int64_t det = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+    bool cw = det > 0;
+    if (det == 0 || (cw && culling == Culling::Cw) || (!cw && culling == Culling::Ccw))
+    {
+        return false;
+    }
+
+    minX = std::max<std::int64_t>(viewport.x, (std::min({x[0], x[1], x[2]}) + one - 1) >> SUBPIXEL_BITS);
+    minY = std::max<std::int64_t>(viewport.y, (std::min({y[0], y[1], y[2]}) + one - 1) >> SUBPIXEL_BITS);
+    maxX = std::min<std::int64_t>(viewport.x + viewport.width - 1, std::max({x[0], x[1], x[2]}) >> SUBPIXEL_BITS);
+    maxY = std::min<std::int64_t>(viewport.y + viewport.height - 1, std::max({y[0], y[1], y[2]}) >> SUBPIXEL_BITS);
+    if (minX > maxX || minY > maxY)
+    {
+        return false;
+    }
+
+    // Edge k in sub-pixels is ex * X + ey * Y + c, |det| at vertex k and zero at the other two.
+    // At the pixel center (x, y) it is one * (ex * x + ey * y) + c, so the sign of the pixel's edge
+    // function is that of ex * x + ey * y + floor(c / one).
+    std::int64_t orientation = cw ? 1 : -1;
+    double invDet = 1.0 / (orientation * det);
+    double b[3];
+    double bx[3];
+    double by[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        int i = (k + 1) % 3;
+        int j = (k + 2) % 3;
+        std::int64_t ex = orientation * (y[i] - y[j]);
+        std::int64_t ey = orientation * (x[j] - x[i]);
+        std::int64_t c = orientation * ((y[j] - y[i]) * x[i] - (x[j] - x[i]) * y[i]);
+        // pixels on the edge are covered if the triangle is right of it, or below it when it is horizontal
+        bool topLeft = ex > 0 || (ex == 0 && ey > 0);
+
+        setup.e0[k] = (c - (topLeft ? 0 : 1)) >> SUBPIXEL_BITS;
+        setup.ex[k] = static_cast<std::int32_t>(ex);
+        setup.ey[k] = static_cast<std::int32_t>(ey);
+        b[k] = c * invDet;
+        bx[k] = ex * one * invDet;
+        by[k] = ey * one * invDet;
+    }
+
+    setup.b0 = static_cast<float>(b[1]);
+    setup.bx = static_cast<float>(bx[1]);
+    setup.by = static_cast<float>(by[1]);
+    setup.c0 = static_cast<float>(b[2]);
+    setup.cx = static_cast<float>(bx[2]);
+    setup.cy = static_cast<float>(by[2]);
+    setup.z0 = static_cast<float>(v[0].z * b[0] + v[1].z * b[1] + v[2].z * b[2]);
+    setup.zx = static_cast<float>(v[0].z * bx[0] + v[1].z * bx[1] + v[2].z * bx[2]);
+    setup.zy = static_cast<float>(v[0].z * by[0] + v[1].z * by[1] + v[2].z * by[2]);
+    for (int i = 0; i < 3; ++i)
+    {
+        setup.z[i] = v[i].z;
+    }
+
+    return true;
+}
+
 template<typename VShader>
 struct VertexBatchTask
 {
@@ -65,172 +371,672 @@ struct VertexBatchTask
 
     void operator()(ThreadParams &params)
     {
-        auto &shader = params.shader;
-        auto &output = params.output;
+        ShadeVertices(params.shader, vertices + startIndex, nullptr, endIndex - startIndex,
+                      params.output.data() + startIndex);
+    }
+};
+
+// Perspective-correct interpolation of a vertex output: v / w of each of its floats and 1 / w are
+// affine functions f0 + fx * x + fy * y of the pixel coordinates, v is their quotient
+template<typename VsOut>
+struct AttributePlanes
+{
+    static constexpr std::size_t FLOATS{sizeof(VsOut) / sizeof(float)};
+
+    float f0[FLOATS];
+    float fx[FLOATS];
+    float fy[FLOATS];
+    float w0, wx, wy;
+
+    void Setup(const VsOut v[3], const RasterSetup &raster) noexcept
+    {
+        float invW[3] = {1.f / v[0].pos.w, 1.f / v[1].pos.w, 1.f / v[2].pos.w};
+        // the values at the vertices over the screen-space barycentrics of RasterSetup
+        auto plane = [&raster](float q0, float q1, float q2, float &f0, float &fx, float &fy) {
+            f0 = q0 + (q1 - q0) * raster.b0 + (q2 - q0) * raster.c0;
+            fx = (q1 - q0) * raster.bx + (q2 - q0) * raster.cx;
+            fy = (q1 - q0) * raster.by + (q2 - q0) * raster.cy;
+        };
 
-        for (auto i = startIndex; i < endIndex; ++i)
+        auto v1f = reinterpret_cast<const float *>(&v[0]);
+        auto v2f = reinterpret_cast<const float *>(&v[1]);
+        auto v3f = reinterpret_cast<const float *>(&v[2]);
+        for (std::size_t j = 0; j < FLOATS; ++j)
         {
-            output[i] = shader(vertices[i]);
+            plane(v1f[j] * invW[0], v2f[j] * invW[1], v3f[j] * invW[2], f0[j], fx[j], fy[j]);
         }
+        plane(invW[0], invW[1], invW[2], w0, wx, wy);
     }
+
+    // 1 / (1 / w), to multiply the planes of the floats with
+    float W(float x, float y) const noexcept { return 1.f / (w0 + wx * x + wy * y); }
+};
+
+// Everything the tile stage needs to rasterize and shade a triangle, computed once when it is binned
+template<typename VsOut>
+struct TriangleSetup
+{
+    RasterSetup            raster;
+    int                    minX;
+    int                    minY;
+    int                    maxX;
+    int                    maxY;
+    AttributePlanes<VsOut> attributes;
+};
+
+// A triangle overlapping a tile. Batches may be binned by any worker, so the tile stage merges the bins
+// of all workers by batch to rasterize the triangles in the order they were submitted.
+struct BinEntry
+{
+    unsigned batch;    // start of the batch that binned the triangle
+    unsigned triangle; // index into the triangles of the worker
 };
 
 template<typename VShader>
-struct RasterBatchTask
+struct BinBatchTask
 {
-    using VsIn  = typename VShader::InType;
     using VsOut = typename VShader::OutType;
 
-    struct Output
+    struct ThreadParams
     {
-        int x;
-        int y;
-        float depth;
-        float b;
-        float c;
-
-        VsOut v1, v2, v3;
+        std::vector<VsOut> &vsOutput;
+        Culling            &culling;
+        const TileGrid     &grid;
+        std::vector<TriangleSetup<VsOut>> triangles;
+        // every triangle overlapping a tile, one bin per tile
+        std::vector<std::vector<BinEntry>> bins;
+        unsigned           batch; // of the triangles being binned
     };
 
     const unsigned *indices;
     std::size_t    start;
     std::size_t    end;
 
-    struct ThreadParams
-    {
-        std::vector<VsOut>  &vsOutput;
-        Culling             &culling;
-        FrameBuffer  &fb;
-        std::vector<Output> output;
-    };
-
     void operator()(ThreadParams &params)
     {
         auto &vsOutput = params.vsOutput;
+        params.batch = start;
         for (auto i = start; i < end; i += 3)
         {
-            ProcessTriangle(vsOutput[indices[i]],
-                            vsOutput[indices[i + 1]],
-                            vsOutput[indices[i + 2]], params);
+            BinTriangle(vsOutput[indices[i]],
+                        vsOutput[indices[i + 1]],
+                        vsOutput[indices[i + 2]], params);
         }
     }
-private:
-    void ProcessTriangle(VsOut &p1, VsOut &p2, VsOut &p3, ThreadParams &params)
+
+    static void BinTriangle(const VsOut &p1, const VsOut &p2, const VsOut &p3, ThreadParams &params)
     {
-        auto &output = params.output;
-        if (p1.pos.w > 0.0f || p2.pos.w > 0.0f || p3.pos.w > 0.0f)
+        // entirely outside one of the planes of the view frustum
+        unsigned outside[3] = {OutCodes(p1.pos, 1.f), OutCodes(p2.pos, 1.f), OutCodes(p3.pos, 1.f)};
+        if (outside[0] & outside[1] & outside[2])
+        {
+            return;
+        }
+
+        // the common case: in front of the near plane and within the guard band, the rasterizer
+        // only visits the part inside the viewport. The far plane is left to the depth test.
+        unsigned clip = (OutCodes(p1.pos, GUARD_BAND) | OutCodes(p2.pos, GUARD_BAND) | OutCodes(p3.pos, GUARD_BAND)) &
+                        ~(1u << CLIP_FAR);
+        if (clip == 0)
         {
+            SetupAndBin(p1, p2, p3, params);
             return;
         }
 
+        // Sutherland-Hodgman against the crossed planes; every plane adds at most one vertex
+        VsOut polygons[2][3 + CLIP_PLANES];
+        VsOut *in = polygons[0];
+        VsOut *out = polygons[1];
+        in[0] = p1;
+        in[1] = p2;
+        in[2] = p3;
+        int count = 3;
+        for (int plane = 0; plane < CLIP_PLANES; ++plane)
+        {
+            if (!(clip & (1u << plane)))
+            {
+                continue;
+            }
+
+            int clipped = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                auto &a = in[i];
+                auto &b = in[(i + 1) % count];
+                float da = ClipDistance(a.pos, plane, GUARD_BAND);
+                float db = ClipDistance(b.pos, plane, GUARD_BAND);
+                if (da >= 0.f)
+                {
+                    out[clipped++] = a;
+                }
+                // interpolate from the inside vertex, so both triangles sharing the edge get the same point
+                if (da >= 0.f && db < 0.f)
+                {
+                    out[clipped++] = Lerp(a, b, da / (da - db));
+                }
+                else if (da < 0.f && db >= 0.f)
+                {
+                    out[clipped++] = Lerp(b, a, db / (db - da));
+                }
+            }
+
+            std::swap(in, out);
+            count = clipped;
+            if (count < 3)
+            {
+                return;
+            }
+        }
+
+        for (int i = 1; i + 1 < count; ++i)
+        {
+            SetupAndBin(in[0], in[i], in[i + 1], params);
+        }
+    }
+
+private:
+    // Interpolates the vertices as arrays of floats, in clip space
+    static VsOut Lerp(const VsOut &a, const VsOut &b, float t)
+    {
+        VsOut result;
+        auto rf = reinterpret_cast<float *>(&result);
+        auto af = reinterpret_cast<const float *>(&a);
+        auto bf = reinterpret_cast<const float *>(&b);
+        for (std::size_t j = 0; j < sizeof(VsOut) / sizeof(float); ++j)
+        {
+            rf[j] = af[j] + t * (bf[j] - af[j]);
+        }
+        return result;
+    }
+
+    static void SetupAndBin(const VsOut &p1, const VsOut &p2, const VsOut &p3, ThreadParams &params)
+    {
         Vec3f v[3] = {Vec3f{p1.pos}, Vec3f{p2.pos}, Vec3f{p3.pos}};
 
-        float dx1 = v[1].x - v[0].x;
-        float dx2 = v[2].x - v[0].x;
-        float dy1 = v[1].y - v[0].y;
-        float dy2 = v[2].y - v[0].y;
-        float det = dx1 * dy2 - dy1 * dx2;
-
-        // Determine the winding of the triangle
-        Vec3f cross = Cross(Vec3f{dx1, dy1, 0}, Vec3f{dx2, dy2, 0});
-        bool cw = cross.z > 0.0f;
-        if (cw && params.culling == Culling::Cw) return;
-        if (!cw && params.culling == Culling::Ccw) return;
-
-        auto clamp = [](float x) {
-            constexpr float eps = 1e-6;
-            return x >= 1.f ? 1.f - eps : (x <= -1.f ? -1.f + eps : x);
-        };
+        TriangleSetup<VsOut> tri;
+        if (!SetupTriangle(v, params.grid.viewport, params.culling, tri.raster, tri.minX, tri.minY, tri.maxX,
+                           tri.maxY))
+        {
+            return;
+        }
+        VsOut vertices[3] = {p1, p2, p3};
+        tri.attributes.Setup(vertices, tri.raster);
+
+        unsigned index = params.triangles.size();
+        for (int ty = tri.minY / TILE_SIZE; ty <= tri.maxY / TILE_SIZE; ++ty)
+        {
+            for (int tx = tri.minX / TILE_SIZE; tx <= tri.maxX / TILE_SIZE; ++tx)
+            {
+                params.bins[params.grid.tilesX * ty + tx].push_back(BinEntry{params.batch, index});
+            }
+        }
+        params.triangles.push_back(tri);
+    }
+};
+
+// Culls, shades and bins a range of meshlets. Vertices shared by meshlets are shaded once per meshlet.
+template<typename VShader>
+struct MeshletBatchTask
+{
+    using VsIn  = typename VShader::InType;
+    using VsOut = typename VShader::OutType;
+    using BinTask = BinBatchTask<VShader>;
+
+    struct ThreadParams
+    {
+        VShader                        &shader;
+        typename BinTask::ThreadParams &binParams;
+        std::vector<VsOut>             output; // vertices of the current meshlet
+    };
 
-        int minX = XNdcToScreen(clamp(std::min(std::min(v[0].x, v[1].x), v[2].x)));
-        int maxX = XNdcToScreen(clamp(std::max(std::max(v[0].x, v[1].x), v[2].x)));
-        int minY = YNdcToScreen(clamp(std::min(std::min(v[0].y, v[1].y), v[2].y)));
-        int maxY = YNdcToScreen(clamp(std::max(std::max(v[0].y, v[1].y), v[2].y)));
+    const MeshletCuller &culler;
+    const VsIn          *vertices;
+    const Mesh::Meshlet *meshlets;
+    const unsigned      *meshletVertices;
+    const std::uint8_t  *meshletTriangles;
+    std::size_t         start;
+    std::size_t         end;
 
-        for (int y = minY; y <= maxY; ++y)
+    void operator()(ThreadParams &params)
+    {
+        auto &output = params.output;
+        params.binParams.batch = start;
+
+        for (auto m = start; m < end; ++m)
         {
-            float ndcY = YScreenToNdc(y);
-            float dy = ndcY - v[0].y;
-            for (int x = minX; x <= maxX; ++x)
+            auto &meshlet = meshlets[m];
+            if (!culler.Visible(meshlet))
             {
-                float ndcX = XScreenToNdc(x);
-                float dx = ndcX - v[0].x;
-                float det1 = dx * dy2 - dy * dx2;
-                float det2 = dx1 * dy - dy1 * dx;
+                continue;
+            }
 
-                float b0 = det1 / det;
-                float c0 = det2 / det;
-                float a0 = 1.f - b0 - c0;
-                if(a0 < 0.f || b0 < 0.f || c0 < 0.f)
-                    continue;
-                float depth = v[0].z * a0 + v[1].z * b0 + v[2].z * c0;
-                float a = a0 / p1.pos.w;
-                float b = b0 / p2.pos.w;
-                float c = c0 / p3.pos.w;
-                float sum = a + b + c;
+            output.resize(std::max<std::size_t>(output.size(), meshlet.vertexCount));
+            ShadeVertices(params.shader, vertices, meshletVertices + meshlet.vertexOffset, meshlet.vertexCount,
+                          output.data());
 
-                output.emplace_back(Output{x, y, depth, b / sum, c / sum, p1, p2, p3});
+            auto tri = meshletTriangles + meshlet.triangleOffset;
+            for (unsigned t = 0; t < meshlet.triangleCount; ++t, tri += 3)
+            {
+                BinTask::BinTriangle(output[tri[0]], output[tri[1]], output[tri[2]], params.binParams);
             }
         }
     }
 };
 
-template<typename Fragment, typename FShader>
-struct FragBatchTask
+template<typename VShader, typename FShader>
+struct TileRenderTask
 {
-    using FsIn = typename FShader::InType;
+    using VsOut = typename VShader::OutType;
+    using FsIn  = typename FShader::InType;
+    using BinParams = typename BinBatchTask<VShader>::ThreadParams;
+    using Triangle = TriangleSetup<VsOut>;
+
+    // Attributes are not copied into fragments, they are read from the shared triangle setup
+    struct Fragment
+    {
+        int      x;
+        int      y;
+        float    depth;
+        unsigned triangle; // index into ThreadParams::triangles
+    };
+
+    // Visibility buffer entry of the deferred mode
+    struct VisibilitySample
+    {
+        unsigned triangle;
+    };
+
+    static constexpr unsigned NO_TRIANGLE{~0u};
+
+    // Consecutive entries of a bin from the same batch
+    struct BinRun
+    {
+        unsigned       batch;
+        const BinEntry *begin;
+        const BinEntry *end;
+        const BinParams *bin;
+    };
 
     struct ThreadParams
     {
-        FShader     &shader;
-        FrameBuffer &frameBuf;
-        DepthBuffer &depthBuf;
-        ScreenLock  &screenLock;
+        std::vector<BinParams>      &binParams;
+        FShader                     &shader;
+        TtyContext                  &context;
+        FrameBuffer                 *frameBuf; // render target of the current frame
+        DepthBuffer                 &depthBuf;
+        HiZBuffer                   &hizBuf;
+        ShadingMode                 &shadingMode;
+        const TileGrid              &grid;
+        RasterKernel                kernel;
+        std::vector<const Triangle *> triangles;
+        std::vector<Fragment>       fragments;
+        std::vector<VisibilitySample> visibility;
+        std::vector<RasterFragment> coverage;
+        std::vector<BinRun>         runs;
     };
 
-    Fragment    *fragments;
-    std::size_t start;
-    std::size_t end;
+    int tileX;
+    int tileY;
 
+    static_assert(TILE_SIZE % RASTER_BLOCK_SIZE == 0, "raster blocks must not cross tile borders");
+
+    // The tile is owned by a single worker, so the depth and color writes need no locking.
+    // Depth is tested and written while rasterizing, so only fragments that are still visible
+    // once the whole tile is rasterized get shaded.
     void operator()(ThreadParams &params)
     {
-        auto &shader = params.shader;
-        auto &frameBuf = params.frameBuf;
+        // the first draw into the tile after TtyContext::Clear clears it while it is still in the cache
+        params.context.ClearTile(tileX, tileY);
+
+        std::size_t tile = params.grid.tilesX * tileY + tileX;
         auto &depthBuf = params.depthBuf;
+        auto &hizMin = params.hizBuf.GetMin();
+        auto &hizMax = params.hizBuf.GetMax();
+        DepthTarget target{depthBuf[0], depthBuf[1] - depthBuf[0], hizMin[0], hizMax[0], hizMax[1] - hizMax[0]};
+
+        // packets are shaded from the visibility buffer in both modes
+        if (params.shadingMode == ShadingMode::Deferred || HasPacketFragmentShader<FShader>::value)
+        {
+            params.visibility.resize(TILE_SIZE * TILE_SIZE, VisibilitySample{NO_TRIANGLE});
+        }
+
+        float tileMaxDepth = TileMaxDepth(params);
+        for (auto &run : MergeBins(tile, params))
+        {
+            for (auto entry = run.begin; entry != run.end; ++entry)
+            {
+                auto &tri = run.bin->triangles[entry->triangle];
+                // the whole triangle is behind everything already drawn in the tile
+                if (std::min({tri.raster.z[0], tri.raster.z[1], tri.raster.z[2]}) > tileMaxDepth)
+                {
+                    continue;
+                }
+
+                if (RasterizeTriangle(tri, target, params))
+                {
+                    tileMaxDepth = TileMaxDepth(params);
+                }
+            }
+        }
+
+        if (params.shadingMode == ShadingMode::Deferred)
+        {
+            ResolveVisibility(params);
+        }
+        else
+        {
+            ShadeFragments(params);
+        }
+        params.triangles.clear();
+        params.fragments.clear();
+    }
+private:
+    // The runs of the tile's bins in submission order. Each batch is binned by a single worker,
+    // so its entries form one run.
+    static const std::vector<BinRun> &MergeBins(std::size_t tile, ThreadParams &params)
+    {
+        auto &runs = params.runs;
+        runs.clear();
+        for (auto &bin : params.binParams)
+        {
+            auto &entries = bin.bins[tile];
+            for (auto first = entries.data(), end = first + entries.size(); first != end;)
+            {
+                auto last = std::find_if(first, end, [first](const BinEntry &e) { return e.batch != first->batch; });
+                runs.push_back(BinRun{first->batch, first, last, &bin});
+                first = last;
+            }
+        }
+        std::sort(runs.begin(), runs.end(), [](const BinRun &a, const BinRun &b) { return a.batch < b.batch; });
+
+        return runs;
+    }
+
+    float TileMaxDepth(ThreadParams &params) const
+    {
+        constexpr int blocks = TILE_SIZE / HIZ_BLOCK_SIZE;
+        auto &hizMax = params.hizBuf.GetMax();
+
+        float maxDepth = -std::numeric_limits<float>::infinity();
+        for (int y = tileY * blocks; y < std::min((tileY + 1) * blocks, hizMax.GetHeight()); ++y)
+        {
+            for (int x = tileX * blocks; x < std::min((tileX + 1) * blocks, hizMax.GetWidth()); ++x)
+            {
+                maxDepth = std::max(maxDepth, hizMax[y][x]);
+            }
+        }
+
+        return maxDepth;
+    }
+
+    bool RasterizeTriangle(const Triangle &tri, const DepthTarget &target, ThreadParams &params)
+    {
+        auto &output = params.fragments;
+        auto &coverage = params.coverage;
+
+        int minX = std::max(tri.minX, tileX * TILE_SIZE);
+        int minY = std::max(tri.minY, tileY * TILE_SIZE);
+        int maxX = std::min(tri.maxX, tileX * TILE_SIZE + TILE_SIZE - 1);
+        int maxY = std::min(tri.maxY, tileY * TILE_SIZE + TILE_SIZE - 1);
+
+        coverage.resize(TILE_SIZE * TILE_SIZE);
+        auto count = params.kernel(tri.raster, target, minX, minY, maxX, maxY, coverage.data());
+        if (count == 0)
+        {
+            return false;
+        }
+
+        unsigned index = params.triangles.size();
+        params.triangles.push_back(&tri);
+        if (params.shadingMode == ShadingMode::Deferred)
+        {
+            // every emitted fragment passed the depth test, so it replaces what was visible before
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                auto &f = coverage[i];
+                auto &sample = params.visibility[(f.y - tileY * TILE_SIZE) * TILE_SIZE + f.x - tileX * TILE_SIZE];
+                sample = VisibilitySample{index};
+            }
+        }
+        else
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                auto &f = coverage[i];
+                output.emplace_back(Fragment{f.x, f.y, f.depth, index});
+            }
+        }
+
+        return true;
+    }
+
+    void ResolveVisibility(ThreadParams &params)
+    {
+        if constexpr (HasPacketFragmentShader<FShader>::value)
+        {
+            ResolvePackets(params);
+            return;
+        }
 
-        for (auto i = start; i < end; ++i)
+        int width = std::min(TILE_SIZE, params.grid.width - tileX * TILE_SIZE);
+        int height = std::min(TILE_SIZE, params.grid.height - tileY * TILE_SIZE);
+        for (int y = 0; y < height; ++y)
         {
-            auto &frag = fragments[i];
+            for (int x = 0; x < width; ++x)
+            {
+                auto &sample = params.visibility[y * TILE_SIZE + x];
+                if (sample.triangle == NO_TRIANGLE)
+                {
+                    continue;
+                }
+
+                Shade(*params.triangles[sample.triangle], tileX * TILE_SIZE + x, tileY * TILE_SIZE + y, params);
+                sample.triangle = NO_TRIANGLE;
+            }
+        }
+    }
 
-            FsIn v;
-            auto vf  = reinterpret_cast<float *>(&v);
-            auto v1f = reinterpret_cast<float *>(&frag.v1);
-            auto v2f = reinterpret_cast<float *>(&frag.v2);
-            auto v3f = reinterpret_cast<float *>(&frag.v3);
+    void ShadeFragments(ThreadParams &params)
+    {
+        auto &depthBuf = params.depthBuf;
 
+        for (auto &frag : params.fragments)
+        {
+            // overwritten by a closer fragment rasterized later
             if (depthBuf[frag.y][frag.x] < frag.depth)
             {
                 continue;
             }
 
-            float a = 1 - frag.b - frag.c;
-            for (std::size_t j = 0; j < sizeof(FsIn) / sizeof(float); ++j)
+            if constexpr (HasPacketFragmentShader<FShader>::value)
+            {
+                // the last one of equally deep fragments wins, as if they were shaded in order
+                auto &sample = params.visibility[(frag.y - tileY * TILE_SIZE) * TILE_SIZE + frag.x - tileX * TILE_SIZE];
+                sample = VisibilitySample{frag.triangle};
+            }
+            else
+            {
+                Shade(*params.triangles[frag.triangle], frag.x, frag.y, params);
+            }
+        }
+
+        if constexpr (HasPacketFragmentShader<FShader>::value)
+        {
+            ResolvePackets(params);
+        }
+    }
+
+    // Quads are shaded two at a time, pairing consecutive quads of the same triangle. The lanes of
+    // a quad the triangle does not cover are interpolated as helpers for the derivatives, but not written.
+    void ResolvePackets(ThreadParams &params)
+    {
+        int width = std::min(TILE_SIZE, params.grid.width - tileX * TILE_SIZE);
+        int height = std::min(TILE_SIZE, params.grid.height - tileY * TILE_SIZE);
+
+        unsigned packetTriangle = NO_TRIANGLE;
+        int quadX[PACKET_QUADS];
+        int quadY[PACKET_QUADS];
+        std::size_t quads = 0;
+        unsigned mask = 0;
+        auto flush = [&]() {
+            if (quads == 0)
+            {
+                return;
+            }
+            // a lone quad is repeated in the empty half, which is not written
+            for (auto quad = quads; quad < PACKET_QUADS; ++quad)
+            {
+                quadX[quad] = quadX[quads - 1];
+                quadY[quad] = quadY[quads - 1];
+            }
+            ShadePacket(*params.triangles[packetTriangle], quadX, quadY, mask, params);
+            quads = 0;
+            mask = 0;
+        };
+
+        for (int qy = 0; qy < height; qy += 2)
+        {
+            for (int qx = 0; qx < width; qx += 2)
             {
-                // interpret input vertices as an array of floats and interpolate over them
-                vf[j] = a * v1f[j] + frag.b * v2f[j] + frag.c * v3f[j];
+                // nullptr for pixels outside the render target
+                VisibilitySample *samples[QUAD_SIZE];
+                for (std::size_t lane = 0; lane < QUAD_SIZE; ++lane)
+                {
+                    int x = qx + lane % 2;
+                    int y = qy + lane / 2;
+                    samples[lane] = x < width && y < height ? &params.visibility[y * TILE_SIZE + x] : nullptr;
+                }
+
+                // one quad per triangle visible in it
+                for (;;)
+                {
+                    auto next = std::find_if(samples, samples + QUAD_SIZE, [](const VisibilitySample *s) {
+                        return s && s->triangle != NO_TRIANGLE;
+                    });
+                    if (next == samples + QUAD_SIZE)
+                    {
+                        break;
+                    }
+
+                    unsigned triangle = (*next)->triangle;
+                    unsigned quadMask = 0;
+                    for (std::size_t lane = 0; lane < QUAD_SIZE; ++lane)
+                    {
+                        if (samples[lane] && samples[lane]->triangle == triangle)
+                        {
+                            quadMask |= 1u << lane;
+                            samples[lane]->triangle = NO_TRIANGLE;
+                        }
+                    }
+
+                    if (triangle != packetTriangle)
+                    {
+                        flush();
+                        packetTriangle = triangle;
+                    }
+                    quadX[quads] = tileX * TILE_SIZE + qx;
+                    quadY[quads] = tileY * TILE_SIZE + qy;
+                    mask |= quadMask << (QUAD_SIZE * quads);
+                    if (++quads == PACKET_QUADS)
+                    {
+                        flush();
+                    }
+                }
             }
+        }
+        flush();
+    }
+
+    void ShadePacket(const Triangle &tri, const int *quadX, const int *quadY, unsigned mask, ThreadParams &params)
+    {
+        alignas(32) float x[PACKET_SIZE];
+        alignas(32) float y[PACKET_SIZE];
+        for (std::size_t lane = 0; lane < PACKET_SIZE; ++lane)
+        {
+            x[lane] = quadX[lane / QUAD_SIZE] + lane % 2;
+            y[lane] = quadY[lane / QUAD_SIZE] + lane % QUAD_SIZE / 2;
+        }
+
+        Packet<FsIn> in;
+        Packet<Vec4f> color;
+        Interpolate(tri, x, y, in);
+        params.shader(in, mask, color);
+
+        for (; mask != 0; mask &= mask - 1)
+        {
+            int lane = __builtin_ctz(mask);
+            (*params.frameBuf)[static_cast<int>(y[lane])][static_cast<int>(x[lane])] =
+                static_cast<Color>(Vec4f{color[0][lane], color[1][lane], color[2][lane], color[3][lane]});
+        }
+    }
+
+    static void Interpolate(const Triangle &tri, float x, float y, FsIn &v)
+    {
+        auto &p = tri.attributes;
+        auto vf = reinterpret_cast<float *>(&v);
+
+        float w = p.W(x, y);
+        for (std::size_t j = 0; j < sizeof(FsIn) / sizeof(float); ++j)
+        {
+            // interpret the output as an array of floats and interpolate over them
+            vf[j] = (p.f0[j] + p.fx[j] * x + p.fy[j] * y) * w;
+        }
+    }
 
-            params.screenLock.Lock(frag.x, frag.y);
-            if (depthBuf[frag.y][frag.x] >= frag.depth)
+    // All lanes at once, attribute by attribute
+    static void Interpolate(const Triangle &tri, const float *x, const float *y, Packet<FsIn> &v)
+    {
+        auto &p = tri.attributes;
+
+        alignas(32) float w[PACKET_SIZE];
+        for (std::size_t lane = 0; lane < PACKET_SIZE; ++lane)
+        {
+            w[lane] = p.W(x[lane], y[lane]);
+        }
+        for (std::size_t j = 0; j < Packet<FsIn>::FLOATS; ++j)
+        {
+            float *lanes = v[j];
+            for (std::size_t lane = 0; lane < PACKET_SIZE; ++lane)
             {
-                frameBuf[frag.y][frag.x] = static_cast<Color>(shader(v));
-                depthBuf[frag.y][frag.x] = frag.depth;
+                lanes[lane] = (p.f0[j] + p.fx[j] * x[lane] + p.fy[j] * y[lane]) * w[lane];
             }
-            params.screenLock.Unlock(frag.x, frag.y);
         }
     }
-};
 
+    // Forward differences towards the right and the lower neighbour. The attributes are evaluated
+    // there even if the neighbour is not covered, like the helper pixels of a 2x2 quad.
+    static void Derivatives(const Triangle &tri, int x, int y, const FsIn &v, FsIn &ddx, FsIn &ddy)
+    {
+        Interpolate(tri, x + 1, y, ddx);
+        Interpolate(tri, x, y + 1, ddy);
+
+        auto vf  = reinterpret_cast<const float *>(&v);
+        auto dxf = reinterpret_cast<float *>(&ddx);
+        auto dyf = reinterpret_cast<float *>(&ddy);
+        for (std::size_t j = 0; j < sizeof(FsIn) / sizeof(float); ++j)
+        {
+            dxf[j] -= vf[j];
+            dyf[j] -= vf[j];
+        }
+    }
+
+    void Shade(const Triangle &tri, int x, int y, ThreadParams &params)
+    {
+        FsIn v;
+        Interpolate(tri, x, y, v);
+
+        if constexpr (HasDerivatives<FShader>::value)
+        {
+            FsIn ddx, ddy;
+            Derivatives(tri, x, y, v, ddx, ddy);
+            (*params.frameBuf)[y][x] = static_cast<Color>(params.shader(v, ddx, ddy));
+        }
+        else
+        {
+            (*params.frameBuf)[y][x] = static_cast<Color>(params.shader(v));
+        }
+    }
+};
 
 }
 
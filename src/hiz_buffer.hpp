@@ -0,0 +1,45 @@
+//
+// Hierarchical depth: min/max depth of every 8x8 pixel block of a DepthBuffer.
+//
+
+#ifndef HIZ_BUFFER_HPP
+#define HIZ_BUFFER_HPP
+
+#include "screen_buffer.hpp"
+
+namespace rst
+{
+
+constexpr int HIZ_BLOCK_SIZE{8};
+
+constexpr int PadToBlocks(int pixels) noexcept
+{
+    return (pixels + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE * HIZ_BLOCK_SIZE;
+}
+
+// The depth buffer is padded to whole blocks, see PadToBlocks
+class HiZBuffer
+{
+public:
+    HiZBuffer(std::size_t width, std::size_t height):
+        m_min{width / HIZ_BLOCK_SIZE, height / HIZ_BLOCK_SIZE},
+        m_max{width / HIZ_BLOCK_SIZE, height / HIZ_BLOCK_SIZE} {}
+
+    ScreenBuffer<float>       &GetMin()       noexcept { return m_min; }
+    const ScreenBuffer<float> &GetMin() const noexcept { return m_min; }
+    ScreenBuffer<float>       &GetMax()       noexcept { return m_max; }
+    const ScreenBuffer<float> &GetMax() const noexcept { return m_max; }
+
+    void Clear(float depth)
+    {
+        m_min.Clear(depth);
+        m_max.Clear(depth);
+    }
+private:
+    ScreenBuffer<float> m_min;
+    ScreenBuffer<float> m_max;
+};
+
+}
+
+#endif //HIZ_BUFFER_HPP
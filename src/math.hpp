@@ -7,6 +7,9 @@
 
 #include <cmath>
 #include <cstddef>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 namespace rst
 {
@@ -255,6 +258,104 @@ Mat<T, N> operator*(const Mat<T, N> &lhs, const Mat<T, N> &rhs) noexcept
 using Mat3f = Mat<float, 3>;
 using Mat4f = Mat<float, 4>;
 
+#ifdef __SSE2__
+// Vec4f and Mat4f rows fit SSE registers. These overloads are picked over the generic templates,
+// naming the template arguments, e.g. Normalize<float, 4>(v), still calls the generic version.
+// The vectors need not be aligned, so the layout of shader structs is unaffected.
+// Dot and Cross stay generic: a horizontal sum in a register is slower than the scalar code,
+// see demos/mathbench.
+
+inline __m128 ToSse(const Vec4f &v) noexcept { return _mm_loadu_ps(v.data); }
+
+inline Vec4f FromSse(__m128 v) noexcept
+{
+    Vec4f result;
+    _mm_storeu_ps(result.data, v);
+    return result;
+}
+
+inline __m128 MulAdd(__m128 a, __m128 b, __m128 c) noexcept
+{
+#ifdef __FMA__
+    return _mm_fmadd_ps(a, b, c);
+#else
+    return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+
+// The sum of the lanes in every lane
+inline __m128 SumLanes(__m128 v) noexcept
+{
+    __m128 sums = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_add_ps(sums, _mm_shuffle_ps(sums, sums, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+inline Vec4f operator+(const Vec4f &lhs, const Vec4f &rhs) noexcept
+{
+    return FromSse(_mm_add_ps(ToSse(lhs), ToSse(rhs)));
+}
+
+inline Vec4f operator-(const Vec4f &lhs, const Vec4f &rhs) noexcept
+{
+    return FromSse(_mm_sub_ps(ToSse(lhs), ToSse(rhs)));
+}
+
+inline Vec4f operator*(const Vec4f &lhs, const Vec4f &rhs) noexcept
+{
+    return FromSse(_mm_mul_ps(ToSse(lhs), ToSse(rhs)));
+}
+
+inline Vec4f operator*(float lhs, const Vec4f &rhs) noexcept
+{
+    return FromSse(_mm_mul_ps(_mm_set1_ps(lhs), ToSse(rhs)));
+}
+
+inline Vec4f operator/(const Vec4f &lhs, float rhs) noexcept
+{
+    return FromSse(_mm_div_ps(ToSse(lhs), _mm_set1_ps(rhs)));
+}
+
+inline Vec4f Normalize(const Vec4f &vec) noexcept
+{
+    __m128 v = ToSse(vec);
+    return FromSse(_mm_div_ps(v, _mm_sqrt_ps(SumLanes(_mm_mul_ps(v, v)))));
+}
+
+inline Vec4f operator*(const Mat4f &lhs, const Vec4f &rhs) noexcept
+{
+    __m128 v = ToSse(rhs);
+    __m128 r0 = _mm_mul_ps(_mm_loadu_ps(lhs[0]), v);
+    __m128 r1 = _mm_mul_ps(_mm_loadu_ps(lhs[1]), v);
+    __m128 r2 = _mm_mul_ps(_mm_loadu_ps(lhs[2]), v);
+    __m128 r3 = _mm_mul_ps(_mm_loadu_ps(lhs[3]), v);
+    // lane i of the sum of the transposed products is the dot product of row i and v
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    return FromSse(_mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3)));
+}
+
+inline Mat4f operator*(const Mat4f &lhs, const Mat4f &rhs) noexcept
+{
+    __m128 rows[4];
+    for (int k = 0; k < 4; ++k)
+    {
+        rows[k] = _mm_loadu_ps(rhs[k]);
+    }
+
+    // row i of the product is the sum of the rows of rhs weighted by row i of lhs
+    Mat4f result;
+    for (int i = 0; i < 4; ++i)
+    {
+        __m128 row = _mm_mul_ps(_mm_set1_ps(lhs[i][0]), rows[0]);
+        row = MulAdd(_mm_set1_ps(lhs[i][1]), rows[1], row);
+        row = MulAdd(_mm_set1_ps(lhs[i][2]), rows[2], row);
+        row = MulAdd(_mm_set1_ps(lhs[i][3]), rows[3], row);
+        _mm_storeu_ps(result[i], row);
+    }
+
+    return result;
+}
+#endif
+
 template<typename T>
 T Clamp(T value, T min, T max) noexcept
 {
@@ -4,141 +4,826 @@
 
 #include <fstream>
 #include <stdexcept>
-#include <sstream>
-#include <cassert>
+#include <unordered_map>
+#include <tuple>
+#include <array>
+#include <algorithm>
+#include <memory>
+#include <charconv>
+#include <string_view>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "mesh.hpp"
+#include "thread_pool.hpp"
 
 namespace rst
 {
 
 Mesh::Mesh(const std::vector<Vertex> &vertices, std::vector<Mesh::uint> indices):
     vertices{vertices},
-    indices{std::move(indices)}
+    indices{std::move(indices)},
+    bounds{},
+    stats{}
 {
+    if (!vertices.empty())
+    {
+        bounds = Aabb{vertices[0].pos, vertices[0].pos};
+    }
+    for (auto &vertex : vertices)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            bounds.min[i] = std::min(bounds.min[i], vertex.pos[i]);
+            bounds.max[i] = std::max(bounds.max[i], vertex.pos[i]);
+        }
+    }
+}
 
+inline std::uint64_t AlignOffset(std::uint64_t offset) noexcept
+{
+    return (offset + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * MESH_FILE_ALIGNMENT;
 }
 
-inline void TransformIndex(int &index, int size) noexcept
+void Mesh::SaveBinary(const std::string &filename) const
 {
-    assert(index != 0);
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open())
+    {
+        throw std::runtime_error("Failed to open " + filename);
+    }
 
-    if (index > 0)
+    // zeroed padding included, the header goes to the file as is
+    MeshFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+    header.version = MESH_FILE_VERSION;
+    header.vertexSize = sizeof(Vertex);
+    header.indexSize = sizeof(uint);
+    header.meshletSize = sizeof(Meshlet);
+    header.vertexCount = vertices.size();
+    header.indexCount = indices.size();
+    header.meshletCount = meshlets.size();
+    header.meshletVertexCount = meshletVertices.size();
+    header.meshletTriangleCount = meshletTriangles.size();
+    header.bounds = bounds;
+
+    struct Array
+    {
+        std::uint64_t &offset;
+        const void    *data;
+        std::size_t   size;
+    };
+    const Array arrays[]{
+        {header.vertexOffset, vertices.data(), sizeof(Vertex) * vertices.size()},
+        {header.indexOffset, indices.data(), sizeof(uint) * indices.size()},
+        {header.meshletOffset, meshlets.data(), sizeof(Meshlet) * meshlets.size()},
+        {header.meshletVertexOffset, meshletVertices.data(), sizeof(uint) * meshletVertices.size()},
+        {header.meshletTriangleOffset, meshletTriangles.data(), meshletTriangles.size()}
+    };
+    std::uint64_t end = sizeof(header);
+    for (auto &array : arrays)
     {
-        index -= 1;
+        array.offset = AlignOffset(end);
+        end = array.offset + array.size;
     }
-    else
+
+    const char padding[MESH_FILE_ALIGNMENT]{};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    end = sizeof(header);
+    for (auto &array : arrays)
+    {
+        out.write(padding, array.offset - end);
+        out.write(static_cast<const char *>(array.data), array.size);
+        end = array.offset + array.size;
+    }
+    if (!out)
     {
-        index = size + index;
+        throw std::runtime_error("Failed to write " + filename);
     }
 }
 
-Mesh Mesh::LoadFromObj(const std::string &filename)
+// Whole file, read-only; nullptr for an empty file
+static void *MapFile(const std::string &filename, std::size_t &size)
 {
-    std::ifstream in(filename);
-    if (!in.is_open())
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
     {
         throw std::runtime_error("Failed to open " + filename);
     }
 
-    std::vector<Vertex> meshVertices;
-    std::vector<uint> meshIndices;
-    
-    std::vector<Vec3f> positions;
-    std::vector<Vec2f> texCoords;
-    std::vector<Vec3f> normals;
+    void *memory = MAP_FAILED;
+    struct stat st{};
+    if (fstat(fd, &st) == 0)
+    {
+        size = st.st_size;
+        memory = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    }
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        throw std::runtime_error("Failed to map " + filename);
+    }
+    return memory;
+}
+
+// True if count elements of elementSize bytes at offset lie inside a file of fileSize bytes,
+// without overflowing on the counts of a damaged header
+static bool ArrayFits(std::uint64_t offset, std::uint64_t count, std::size_t elementSize, std::size_t fileSize)
+{
+    return offset <= fileSize && count <= (fileSize - offset) / elementSize;
+}
 
-    std::string line;
-    while (std::getline(in, line))
+// True if every index addresses a vertex and every meshlet addresses its own vertices and triangles only,
+// so the rasterizer can trust the file
+static bool ValidIndices(const MeshFileHeader &h, const uint *indices, const Mesh::Meshlet *meshlets,
+                         const uint *meshletVertices, const std::uint8_t *meshletTriangles)
+{
+    auto isVertex = [&h](uint index) { return index < h.vertexCount; };
+    if (h.indexCount % 3 != 0 || !std::all_of(indices, indices + h.indexCount, isVertex) ||
+        !std::all_of(meshletVertices, meshletVertices + h.meshletVertexCount, isVertex))
     {
-        std::istringstream iss{line};
-        std::string word;
-        iss >> word;
+        return false;
+    }
 
-        if (word == "v")
+    for (auto meshlet = meshlets; meshlet != meshlets + h.meshletCount; ++meshlet)
+    {
+        if (meshlet->vertexOffset > h.meshletVertexCount ||
+            meshlet->vertexCount > h.meshletVertexCount - meshlet->vertexOffset ||
+            meshlet->triangleOffset > h.meshletTriangleCount ||
+            meshlet->triangleCount > (h.meshletTriangleCount - meshlet->triangleOffset) / 3)
         {
-            Vec3f pos;
-            if (!(iss >> pos.x >> pos.y >> pos.z))
-            {
-                throw std::runtime_error("Obj parser: failed to parse line " + line);
-            }
-            positions.push_back(pos);
+            return false;
         }
-        else if (word == "vt")
+        auto triangles = meshletTriangles + meshlet->triangleOffset;
+        if (!std::all_of(triangles, triangles + 3 * std::size_t{meshlet->triangleCount},
+                         [meshlet](std::uint8_t local) { return local < meshlet->vertexCount; }))
         {
-            Vec2f uv;
-            if (!(iss >> uv.x >> uv.y))
+            return false;
+        }
+    }
+    return true;
+}
+
+MappedMesh::MappedMesh(const std::string &filename):
+    m_memory{nullptr},
+    m_size{0}
+{
+    m_memory = MapFile(filename, m_size);
+    if (m_size < sizeof(MeshFileHeader))
+    {
+        munmap(m_memory, m_size);
+        throw std::runtime_error("Mesh cache: bad header in " + filename);
+    }
+
+    m_header = static_cast<const MeshFileHeader *>(m_memory);
+    auto &h = *m_header;
+    if (std::memcmp(h.magic, MESH_FILE_MAGIC, sizeof(h.magic)) != 0 || h.version != MESH_FILE_VERSION ||
+        h.vertexSize != sizeof(Vertex) || h.indexSize != sizeof(uint) || h.meshletSize != sizeof(Meshlet) ||
+        !ArrayFits(h.vertexOffset, h.vertexCount, sizeof(Vertex), m_size) ||
+        !ArrayFits(h.indexOffset, h.indexCount, sizeof(uint), m_size) ||
+        !ArrayFits(h.meshletOffset, h.meshletCount, sizeof(Meshlet), m_size) ||
+        !ArrayFits(h.meshletVertexOffset, h.meshletVertexCount, sizeof(uint), m_size) ||
+        !ArrayFits(h.meshletTriangleOffset, h.meshletTriangleCount, 1, m_size))
+    {
+        munmap(m_memory, m_size);
+        throw std::runtime_error("Mesh cache: bad header in " + filename);
+    }
+
+    auto base = static_cast<const char *>(m_memory);
+    m_vertices = reinterpret_cast<const Vertex *>(base + h.vertexOffset);
+    m_indices = reinterpret_cast<const uint *>(base + h.indexOffset);
+    m_meshlets = reinterpret_cast<const Meshlet *>(base + h.meshletOffset);
+    m_meshletVertices = reinterpret_cast<const uint *>(base + h.meshletVertexOffset);
+    m_meshletTriangles = reinterpret_cast<const std::uint8_t *>(base + h.meshletTriangleOffset);
+
+    // checked once here instead of on every draw
+    if (!ValidIndices(h, m_indices, m_meshlets, m_meshletVertices, m_meshletTriangles))
+    {
+        munmap(m_memory, m_size);
+        throw std::runtime_error("Mesh cache: out of range indices in " + filename);
+    }
+}
+
+MappedMesh::~MappedMesh() noexcept
+{
+    munmap(m_memory, m_size);
+}
+
+float Mesh::Acmr(std::size_t cacheSize) const
+{
+    if (indices.empty())
+    {
+        return 0.0f;
+    }
+
+    // FIFO post-transform cache
+    std::vector<std::size_t> insertedAt(vertices.size(), 0);
+    std::size_t misses = 0;
+    for (auto index : indices)
+    {
+        if (insertedAt[index] == 0 || misses - insertedAt[index] >= cacheSize)
+        {
+            insertedAt[index] = ++misses;
+        }
+    }
+
+    return static_cast<float>(misses) / (indices.size() / 3);
+}
+
+// Tipsify (Sander, Nehab, Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"):
+// fans around a vertex still in the cache, falling back to recently used vertices on dead ends
+void Mesh::OptimizeVertexCache(std::size_t cacheSize)
+{
+    std::size_t vertexCount = vertices.size();
+    std::size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0)
+    {
+        return;
+    }
+
+    // vertex -> triangle adjacency
+    std::vector<uint> liveTriangles(vertexCount, 0);
+    for (auto index : indices)
+    {
+        ++liveTriangles[index];
+    }
+    std::vector<uint> adjacencyStart(vertexCount + 1, 0);
+    for (std::size_t v = 0; v < vertexCount; ++v)
+    {
+        adjacencyStart[v + 1] = adjacencyStart[v] + liveTriangles[v];
+    }
+    std::vector<uint> adjacency(indices.size());
+    std::vector<uint> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    for (std::size_t i = 0; i < indices.size(); ++i)
+    {
+        adjacency[fill[indices[i]]++] = i / 3;
+    }
+
+    std::vector<uint> output;
+    output.reserve(indices.size());
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<std::size_t> cacheTime(vertexCount, 0);
+    std::vector<uint> deadEnd;
+    std::vector<uint> candidates;
+    std::size_t time = cacheSize + 1;
+    std::size_t cursor = 0;
+    long fanning = 0;
+
+    while (fanning >= 0)
+    {
+        candidates.clear();
+        for (auto a = adjacencyStart[fanning]; a < adjacencyStart[fanning + 1]; ++a)
+        {
+            auto triangle = adjacency[a];
+            if (emitted[triangle])
             {
-                throw std::runtime_error("Obj parser: failed to parse line " + line);
+                continue;
+            }
+            emitted[triangle] = true;
+
+            for (int k = 0; k < 3; ++k)
+            {
+                auto v = indices[3 * triangle + k];
+                output.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                --liveTriangles[v];
+                if (time - cacheTime[v] > cacheSize)
+                {
+                    cacheTime[v] = time++;
+                }
             }
-            texCoords.push_back(uv);
         }
-        else if (word == "vn")
+
+        // prefer the candidate that will still be in the cache after fanning around it
+        fanning = -1;
+        long bestPriority = -1;
+        for (auto v : candidates)
         {
-            Vec3f normal;
-            if (!(iss >> normal.x >> normal.y >> normal.z))
+            if (liveTriangles[v] == 0)
+            {
+                continue;
+            }
+            long priority = 0;
+            if (time - cacheTime[v] + 2 * liveTriangles[v] <= cacheSize)
             {
-                throw std::runtime_error("Obj parser: failed to parse line " + line);
+                priority = time - cacheTime[v];
+            }
+            if (priority > bestPriority)
+            {
+                bestPriority = priority;
+                fanning = v;
             }
-            normals.push_back(Normalize(normal));
         }
-        else if (word == "f")
+
+        if (fanning < 0)
         {
-            std::size_t vertSize = meshVertices.size();
-            std::string face;
-            while ((iss >> face))
+            while (!deadEnd.empty() && fanning < 0)
             {
-                Vertex vertex;
-                int vertIndex = 0;
-                int uvIndex = 0;
-                int normIndex = 0;
-
-                if (std::sscanf(face.c_str(), "%d/%d/%d", &vertIndex, &uvIndex, &normIndex) == 3)
+                auto v = deadEnd.back();
+                deadEnd.pop_back();
+                if (liveTriangles[v] > 0)
                 {
-                    TransformIndex(vertIndex, positions.size());
-                    vertex.pos = positions[vertIndex];
-                    TransformIndex(uvIndex, texCoords.size());
-                    vertex.tex = texCoords[uvIndex];
-                    TransformIndex(normIndex, normals.size());
-                    vertex.norm = normals[normIndex];
+                    fanning = v;
                 }
-                else if (std::sscanf(face.c_str(), "%d//%d", &vertIndex, &normIndex) == 2)
+            }
+            for (; fanning < 0 && cursor < vertexCount; ++cursor)
+            {
+                if (liveTriangles[cursor] > 0)
                 {
-                    TransformIndex(vertIndex, positions.size());
-                    vertex.pos = positions[vertIndex];
-                    TransformIndex(normIndex, normals.size());
-                    vertex.norm = normals[normIndex];
+                    fanning = cursor;
                 }
-                else if (std::sscanf(face.c_str(), "%d/%d", &vertIndex, &uvIndex) == 2)
+            }
+        }
+    }
+
+    // renumber vertices in the order they are first referenced for fetch locality
+    std::vector<uint> remap(vertexCount, ~0u);
+    std::vector<Vertex> reordered;
+    reordered.reserve(vertexCount);
+    for (auto &index : output)
+    {
+        if (remap[index] == ~0u)
+        {
+            remap[index] = reordered.size();
+            reordered.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+
+    vertices = std::move(reordered);
+    indices = std::move(output);
+}
+
+// Bounding sphere centered in the box of the vertices, and the cone around the average face normal.
+// A face normal is the cross product of its edges, it points to the side the triangle is counter-clockwise from.
+static void ComputeMeshletBounds(const Mesh &mesh, Mesh::Meshlet &meshlet)
+{
+    auto position = [&](unsigned i) {
+        return mesh.vertices[mesh.meshletVertices[meshlet.vertexOffset + i]].pos;
+    };
+    auto normal = [&](unsigned t) {
+        auto tri = &mesh.meshletTriangles[meshlet.triangleOffset + 3 * t];
+        Vec3f p0 = position(tri[0]);
+        return Cross(position(tri[1]) - p0, position(tri[2]) - p0);
+    };
+
+    Vec3f min = position(0);
+    Vec3f max = min;
+    for (unsigned i = 1; i < meshlet.vertexCount; ++i)
+    {
+        Vec3f p = position(i);
+        for (int k = 0; k < 3; ++k)
+        {
+            min[k] = std::min(min[k], p[k]);
+            max[k] = std::max(max[k], p[k]);
+        }
+    }
+    meshlet.center = 0.5f * (min + max);
+    meshlet.radius = 0.f;
+    for (unsigned i = 0; i < meshlet.vertexCount; ++i)
+    {
+        meshlet.radius = std::max(meshlet.radius, Magnitude(position(i) - meshlet.center));
+    }
+
+    Vec3f sum{0.f, 0.f, 0.f};
+    for (unsigned t = 0; t < meshlet.triangleCount; ++t)
+    {
+        Vec3f n = normal(t);
+        float length = Magnitude(n);
+        if (length > 0.f)
+        {
+            sum = sum + n / length;
+        }
+    }
+    float length = Magnitude(sum);
+    meshlet.coneAxis = length > 0.f ? sum / length : Vec3f{0.f, 0.f, 1.f};
+    meshlet.coneCutoff = 1.f;
+    if (length == 0.f)
+    {
+        return;
+    }
+
+    float minDot = 1.f;
+    for (unsigned t = 0; t < meshlet.triangleCount; ++t)
+    {
+        Vec3f n = normal(t);
+        float length = Magnitude(n);
+        if (length > 0.f)
+        {
+            minDot = std::min(minDot, Dot(n, meshlet.coneAxis) / length);
+        }
+    }
+    if (minDot > 0.f)
+    {
+        meshlet.coneCutoff = std::sqrt(1.f - minDot * minDot);
+    }
+}
+
+// Greedy: consecutive triangles go to the open meshlet until it runs out of vertices or triangles.
+// The vertex cache order keeps neighbouring triangles together, which keeps the clusters compact.
+void Mesh::BuildMeshlets()
+{
+    meshlets.clear();
+    meshletVertices.clear();
+    meshletTriangles.clear();
+
+    // meshlet-local index of the vertices of the open meshlet
+    std::vector<uint> local(vertices.size(), ~0u);
+    Meshlet meshlet{};
+    auto close = [&]() {
+        if (meshlet.triangleCount == 0)
+        {
+            return;
+        }
+        for (uint i = 0; i < meshlet.vertexCount; ++i)
+        {
+            local[meshletVertices[meshlet.vertexOffset + i]] = ~0u;
+        }
+        ComputeMeshletBounds(*this, meshlet);
+        meshlets.push_back(meshlet);
+        meshlet = Meshlet{};
+        meshlet.vertexOffset = meshletVertices.size();
+        meshlet.triangleOffset = meshletTriangles.size();
+    };
+
+    for (std::size_t i = 0; i + 2 < indices.size(); i += 3)
+    {
+        uint added = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            added += local[indices[i + k]] == ~0u;
+        }
+        if (meshlet.vertexCount + added > MESHLET_MAX_VERTICES || meshlet.triangleCount == MESHLET_MAX_TRIANGLES)
+        {
+            close();
+        }
+
+        for (int k = 0; k < 3; ++k)
+        {
+            auto &slot = local[indices[i + k]];
+            if (slot == ~0u)
+            {
+                slot = meshlet.vertexCount++;
+                meshletVertices.push_back(indices[i + k]);
+            }
+            meshletTriangles.push_back(slot);
+        }
+        ++meshlet.triangleCount;
+    }
+    close();
+}
+
+namespace
+{
+
+// Bit k of ObjCorner::present / ObjCorner::relative refers to index[k]
+constexpr int OBJ_POSITION{0};
+constexpr int OBJ_TEXCOORD{1};
+constexpr int OBJ_NORMAL{2};
+
+// Smallest slice worth handing to a separate worker
+constexpr std::size_t OBJ_MIN_CHUNK_SIZE{1 << 20};
+
+struct ObjCorner
+{
+    int      index[3];
+    unsigned present;
+    unsigned relative; // negative OBJ index, resolved against the chunk-local count
+};
+
+// A slice of the file starting and ending on line boundaries. Chunks are parsed independently,
+// so negative indices can only be resolved once the element counts of the preceding chunks are known
+struct ObjChunk
+{
+    const char             *begin;
+    const char             *end;
+    std::vector<Vec3f>     positions;
+    std::vector<Vec2f>     texCoords;
+    std::vector<Vec3f>     normals;
+    std::vector<ObjCorner> corners;
+    std::vector<unsigned>  faceSizes;
+    std::string            error;
+};
+
+inline bool IsSpace(char c) noexcept
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char *SkipSpaces(const char *p, const char *end) noexcept
+{
+    while (p < end && IsSpace(*p))
+    {
+        ++p;
+    }
+    return p;
+}
+
+template<typename T>
+inline bool ParseNumber(const char *&p, const char *end, T &value) noexcept
+{
+    p = SkipSpaces(p, end);
+    if (p < end && *p == '+')
+    {
+        ++p;
+    }
+    auto result = std::from_chars(p, end, value);
+    p = result.ptr;
+    return result.ec == std::errc{};
+}
+
+inline bool ParseIndex(const char *&p, const char *end, std::size_t count, int k, ObjCorner &corner) noexcept
+{
+    int index = 0;
+    if (!ParseNumber(p, end, index) || index == 0)
+    {
+        return false;
+    }
+
+    corner.present |= 1u << k;
+    if (index > 0)
+    {
+        corner.index[k] = index - 1;
+    }
+    else
+    {
+        corner.index[k] = static_cast<int>(count) + index;
+        corner.relative |= 1u << k;
+    }
+    return true;
+}
+
+// v, v/vt, v//vn or v/vt/vn
+bool ParseCorner(const char *&p, const char *end, const ObjChunk &chunk, ObjCorner &corner) noexcept
+{
+    corner = ObjCorner{};
+    if (!ParseIndex(p, end, chunk.positions.size(), OBJ_POSITION, corner))
+    {
+        return false;
+    }
+    if (p < end && *p == '/')
+    {
+        ++p;
+        if (p < end && *p != '/' && !ParseIndex(p, end, chunk.texCoords.size(), OBJ_TEXCOORD, corner))
+        {
+            return false;
+        }
+        if (p < end && *p == '/')
+        {
+            ++p;
+            if (!ParseIndex(p, end, chunk.normals.size(), OBJ_NORMAL, corner))
+            {
+                return false;
+            }
+        }
+    }
+    return p == end || IsSpace(*p);
+}
+
+bool ParseLine(const char *p, const char *end, ObjChunk &chunk)
+{
+    p = SkipSpaces(p, end);
+    auto word = p;
+    while (p < end && !IsSpace(*p))
+    {
+        ++p;
+    }
+    std::string_view keyword(word, p - word);
+
+    if (keyword == "v")
+    {
+        Vec3f pos;
+        if (!ParseNumber(p, end, pos.x) || !ParseNumber(p, end, pos.y) || !ParseNumber(p, end, pos.z))
+        {
+            return false;
+        }
+        chunk.positions.push_back(pos);
+    }
+    else if (keyword == "vt")
+    {
+        Vec2f uv;
+        if (!ParseNumber(p, end, uv.x) || !ParseNumber(p, end, uv.y))
+        {
+            return false;
+        }
+        chunk.texCoords.push_back(uv);
+    }
+    else if (keyword == "vn")
+    {
+        Vec3f normal;
+        if (!ParseNumber(p, end, normal.x) || !ParseNumber(p, end, normal.y) || !ParseNumber(p, end, normal.z))
+        {
+            return false;
+        }
+        chunk.normals.push_back(Normalize(normal));
+    }
+    else if (keyword == "f")
+    {
+        unsigned size = 0;
+        for (p = SkipSpaces(p, end); p < end; p = SkipSpaces(p, end))
+        {
+            ObjCorner corner;
+            if (!ParseCorner(p, end, chunk, corner))
+            {
+                return false;
+            }
+            chunk.corners.push_back(corner);
+            ++size;
+        }
+        if (size == 0)
+        {
+            return false;
+        }
+        chunk.faceSizes.push_back(size);
+    }
+    return true;
+}
+
+void ParseChunk(ObjChunk &chunk)
+{
+    for (auto line = chunk.begin; line < chunk.end;)
+    {
+        auto lineEnd = static_cast<const char *>(std::memchr(line, '\n', chunk.end - line));
+        if (lineEnd == nullptr)
+        {
+            lineEnd = chunk.end;
+        }
+        if (!ParseLine(line, lineEnd, chunk))
+        {
+            chunk.error = "Obj parser: failed to parse line " + std::string(line, lineEnd);
+            return;
+        }
+        line = lineEnd + 1;
+    }
+}
+
+struct Unmapper
+{
+    std::size_t size;
+
+    void operator()(void *memory) const noexcept
+    {
+        munmap(memory, size);
+    }
+};
+
+}
+
+Mesh Mesh::LoadFromObj(const std::string &filename, std::size_t threads)
+{
+    std::size_t size = 0;
+    std::unique_ptr<void, Unmapper> file{MapFile(filename, size), Unmapper{size}};
+    auto text = static_cast<const char *>(file.get());
+
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::size_t chunkCount = std::clamp<std::size_t>(size / OBJ_MIN_CHUNK_SIZE, 1, threads * 4);
+
+    // cut the file into roughly equal slices, moving every cut to the next line start
+    std::vector<ObjChunk> chunks(chunkCount);
+    const char *cut = text;
+    for (std::size_t i = 0; i < chunkCount; ++i)
+    {
+        const char *end = text + size;
+        if (i + 1 < chunkCount)
+        {
+            end = std::max(cut, text + size / chunkCount * (i + 1));
+            auto newline = static_cast<const char *>(std::memchr(end, '\n', text + size - end));
+            end = newline != nullptr ? newline + 1 : text + size;
+        }
+        chunks[i].begin = cut;
+        chunks[i].end = end;
+        cut = end;
+    }
+
+    if (chunkCount == 1)
+    {
+        ParseChunk(chunks[0]);
+    }
+    else
+    {
+        ThreadPool pool{std::min(threads, chunkCount)};
+        for (auto &chunk : chunks)
+        {
+            pool.EnqueueTask([&chunk](std::size_t) {
+                try
                 {
-                    TransformIndex(vertIndex, positions.size());
-                    vertex.pos = positions[vertIndex];
-                    TransformIndex(uvIndex, texCoords.size());
-                    vertex.tex = texCoords[uvIndex];
+                    ParseChunk(chunk);
                 }
-                else
+                catch (const std::exception &e)
                 {
-                    throw std::runtime_error("Obj parser: failed to parse line " + line);
+                    chunk.error = e.what();
                 }
+            });
+        }
+        pool.Wait();
+    }
 
-                meshVertices.push_back(vertex);
-            }
+    // merge in file order; chunk bases turn chunk-local relative indices into absolute ones
+    std::vector<Vec3f> positions;
+    std::vector<Vec2f> texCoords;
+    std::vector<Vec3f> normals;
+    std::vector<std::array<std::size_t, 3>> bases(chunkCount);
+    for (std::size_t i = 0; i < chunkCount; ++i)
+    {
+        auto &chunk = chunks[i];
+        if (!chunk.error.empty())
+        {
+            throw std::runtime_error(chunk.error);
+        }
+        bases[i] = {positions.size(), texCoords.size(), normals.size()};
+        positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+        texCoords.insert(texCoords.end(), chunk.texCoords.begin(), chunk.texCoords.end());
+        normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+    }
+    file.reset();
+    const std::size_t counts[3]{positions.size(), texCoords.size(), normals.size()};
+
+    std::vector<Vertex> meshVertices;
+    std::vector<uint> meshIndices;
+
+    // face corners sharing position, texture coordinate and normal share a vertex
+    struct CornerHash
+    {
+        std::size_t operator()(const std::tuple<int, int, int> &key) const noexcept
+        {
+            return std::get<0>(key) * 73856093u ^ std::get<1>(key) * 19349663u ^ std::get<2>(key) * 83492791u;
+        }
+    };
+    std::unordered_map<std::tuple<int, int, int>, uint, CornerHash> vertexIds;
+    std::vector<uint> face;
+    std::size_t corners = 0;
 
-            std::size_t verticesInFace = meshVertices.size() - vertSize;
-            if (verticesInFace == 0)
+    for (std::size_t i = 0; i < chunkCount; ++i)
+    {
+        auto corner = chunks[i].corners.cbegin();
+        for (auto faceSize : chunks[i].faceSizes)
+        {
+            face.clear();
+            for (unsigned j = 0; j < faceSize; ++j, ++corner)
             {
-                throw std::runtime_error("Obj parser: failed to parse line " + line);
+                int key[3]{-1, -1, -1};
+                for (int k = 0; k < 3; ++k)
+                {
+                    if (!(corner->present & (1u << k)))
+                    {
+                        continue;
+                    }
+                    long index = corner->index[k];
+                    if (corner->relative & (1u << k))
+                    {
+                        index += bases[i][k];
+                    }
+                    if (index < 0 || static_cast<std::size_t>(index) >= counts[k])
+                    {
+                        throw std::runtime_error("Obj parser: index out of range in " + filename);
+                    }
+                    key[k] = index;
+                }
+
+                auto inserted = vertexIds.emplace(std::make_tuple(key[OBJ_POSITION], key[OBJ_TEXCOORD], key[OBJ_NORMAL]),
+                                                  meshVertices.size());
+                if (inserted.second)
+                {
+                    Vertex vertex{};
+                    vertex.pos = positions[key[OBJ_POSITION]];
+                    if (key[OBJ_TEXCOORD] >= 0)
+                    {
+                        vertex.tex = texCoords[key[OBJ_TEXCOORD]];
+                    }
+                    if (key[OBJ_NORMAL] >= 0)
+                    {
+                        vertex.norm = normals[key[OBJ_NORMAL]];
+                    }
+                    meshVertices.push_back(vertex);
+                }
+                face.push_back(inserted.first->second);
             }
+            corners += faceSize;
 
-            for (std::size_t i = 1; i < verticesInFace - 1; i++)
+            for (std::size_t j = 1; j + 1 < face.size(); j++)
             {
-                meshIndices.push_back(vertSize);
-                meshIndices.push_back(vertSize + i);
-                meshIndices.push_back(vertSize + i + 1);
+                meshIndices.push_back(face[0]);
+                meshIndices.push_back(face[j]);
+                meshIndices.push_back(face[j + 1]);
             }
         }
     }
 
-    return Mesh{meshVertices, meshIndices};
+    Mesh mesh{meshVertices, meshIndices};
+    mesh.stats.corners = corners;
+    mesh.stats.acmrBefore = mesh.Acmr();
+    mesh.OptimizeVertexCache();
+    mesh.stats.acmrAfter = mesh.Acmr();
+    mesh.BuildMeshlets();
+
+    return mesh;
 }
 
 }
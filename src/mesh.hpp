@@ -10,10 +10,17 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <cstdint>
 
 namespace rst
 {
 
+struct Aabb
+{
+    Vec3f min;
+    Vec3f max;
+};
+
 struct Mesh
 {
 public:
@@ -26,11 +33,108 @@ public:
         Vec3f norm;
     };
 
-    std::vector<Vertex> vertices;
-    std::vector<uint>   indices;
+    // Filled in by the loader
+    struct Stats
+    {
+        std::size_t corners;    // face corners in the source file, i.e. vertices before deduplication
+        float       acmrBefore; // average cache miss ratio in file order
+        float       acmrAfter;  // average cache miss ratio after OptimizeVertexCache
+    };
+
+    // Cluster of consecutive triangles, culled as a whole by the rasterizer
+    struct Meshlet
+    {
+        uint  vertexOffset;   // into meshletVertices
+        uint  vertexCount;
+        uint  triangleOffset; // into meshletTriangles, three meshlet-local vertex indices per triangle
+        uint  triangleCount;
+        Vec3f center;         // bounding sphere of the vertices
+        float radius;
+        Vec3f coneAxis;       // normal cone of the faces
+        float coneCutoff;     // sine of the cone's half angle, 1 if the faces do not fit in a half space
+    };
+
+    static constexpr std::size_t VERTEX_CACHE_SIZE{32};
+    static constexpr std::size_t MESHLET_MAX_VERTICES{64};
+    static constexpr std::size_t MESHLET_MAX_TRIANGLES{124};
+
+    std::vector<Vertex>       vertices;
+    std::vector<uint>         indices;
+    Aabb                      bounds;
+    Stats                     stats;
+    std::vector<Meshlet>      meshlets;
+    std::vector<uint>         meshletVertices;  // indices into vertices
+    std::vector<std::uint8_t> meshletTriangles;
 
     Mesh(const std::vector<Vertex>& vertices, std::vector<uint> indices);
-    static Mesh LoadFromObj(const std::string& filename);
+    float Acmr(std::size_t cacheSize = VERTEX_CACHE_SIZE) const;
+    void  OptimizeVertexCache(std::size_t cacheSize = VERTEX_CACHE_SIZE);
+    // Cuts the index buffer in its current order into meshlets, so run it after OptimizeVertexCache
+    void  BuildMeshlets();
+    void  SaveBinary(const std::string& filename) const;
+    // The file is mapped and parsed in line-aligned chunks on up to `threads` workers,
+    // 0 picks the hardware concurrency
+    static Mesh LoadFromObj(const std::string& filename, std::size_t threads = 0);
+};
+
+// Layout of the binary mesh cache written by Mesh::SaveBinary: this header, then the vertex,
+// index, meshlet, meshlet vertex and meshlet triangle arrays at MESH_FILE_ALIGNMENT aligned offsets
+struct MeshFileHeader
+{
+    char          magic[4];
+    std::uint32_t version;
+    std::uint32_t vertexSize;
+    std::uint32_t indexSize;
+    std::uint32_t meshletSize;
+    std::uint64_t vertexCount;
+    std::uint64_t indexCount;
+    std::uint64_t meshletCount;
+    std::uint64_t meshletVertexCount;
+    std::uint64_t meshletTriangleCount; // in bytes, three per triangle
+    std::uint64_t vertexOffset;
+    std::uint64_t indexOffset;
+    std::uint64_t meshletOffset;
+    std::uint64_t meshletVertexOffset;
+    std::uint64_t meshletTriangleOffset;
+    Aabb          bounds;
+};
+
+constexpr char          MESH_FILE_MAGIC[4]{'R', 'S', 'T', 'M'};
+constexpr std::uint32_t MESH_FILE_VERSION{2};
+constexpr std::size_t   MESH_FILE_ALIGNMENT{64};
+
+// Mesh cache mapped into memory: the arrays point straight into the file, nothing is parsed or copied
+class MappedMesh
+{
+public:
+    using Vertex = Mesh::Vertex;
+    using Meshlet = Mesh::Meshlet;
+    using uint = Mesh::uint;
+
+    explicit   MappedMesh(const std::string &filename);
+               MappedMesh(const MappedMesh &) = delete;
+    MappedMesh &operator=(const MappedMesh &) = delete;
+               ~MappedMesh() noexcept;
+
+    const Vertex *Vertices()    const noexcept { return m_vertices; }
+    std::size_t  VertexCount()  const noexcept { return m_header->vertexCount; }
+    const uint   *Indices()     const noexcept { return m_indices; }
+    std::size_t  IndexCount()   const noexcept { return m_header->indexCount; }
+    const Aabb   &Bounds()      const noexcept { return m_header->bounds; }
+
+    const Meshlet      *Meshlets()         const noexcept { return m_meshlets; }
+    std::size_t        MeshletCount()      const noexcept { return m_header->meshletCount; }
+    const uint         *MeshletVertices()  const noexcept { return m_meshletVertices; }
+    const std::uint8_t *MeshletTriangles() const noexcept { return m_meshletTriangles; }
+private:
+    void                 *m_memory;
+    std::size_t          m_size;
+    const MeshFileHeader *m_header;
+    const Vertex         *m_vertices;
+    const uint           *m_indices;
+    const Meshlet        *m_meshlets;
+    const uint           *m_meshletVertices;
+    const std::uint8_t   *m_meshletTriangles;
 };
 
 };
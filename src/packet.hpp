@@ -0,0 +1,131 @@
+//
+// Structure-of-arrays packets for shading several vertices per call.
+//
+
+#ifndef PACKET_HPP
+#define PACKET_HPP
+
+#include "math.hpp"
+#include <cstddef>
+#include <algorithm>
+
+namespace rst
+{
+
+// Lanes per packet, one AVX register of floats
+constexpr std::size_t PACKET_SIZE{8};
+
+// Fragment packets hold two 2x2 quads of pixels, not necessarily adjacent:
+// lane = QUAD_SIZE * quad + 2 * row + column, rows going the way pixel y does
+constexpr std::size_t QUAD_SIZE{4};
+constexpr std::size_t PACKET_QUADS{PACKET_SIZE / QUAD_SIZE};
+
+// PACKET_SIZE structs made of floats, stored member-wise: float j of every lane is contiguous,
+// so loops over the lanes vectorize
+template<typename T>
+struct Packet
+{
+    static_assert(sizeof(T) % sizeof(float) == 0, "packets hold structs made of floats");
+    static constexpr std::size_t FLOATS{sizeof(T) / sizeof(float)};
+
+    alignas(32) float data[FLOATS][PACKET_SIZE];
+
+    float       *operator[](std::size_t j)       noexcept { return data[j]; }
+    const float *operator[](std::size_t j) const noexcept { return data[j]; }
+
+    // Lanes of component k of a member, e.g. in.Lanes(&Vertex::pos, 1) for pos.y
+    template<typename M>
+    float       *Lanes(M T::*member, std::size_t k = 0)       noexcept { return data[Offset(member) + k]; }
+    template<typename M>
+    const float *Lanes(M T::*member, std::size_t k = 0) const noexcept { return data[Offset(member) + k]; }
+
+    // Transposes count <= PACKET_SIZE structs in; the missing lanes repeat the last one
+    void Load(const T *items, std::size_t count) noexcept;
+    // Same, gathering items[indices[i]]
+    void Load(const T *items, const unsigned *indices, std::size_t count) noexcept;
+    // Transposes the first count lanes out
+    void Store(T *items, std::size_t count) const noexcept;
+private:
+    template<typename M>
+    static std::size_t Offset(M T::*member) noexcept
+    {
+        T probe{};
+        return (reinterpret_cast<const char *>(&(probe.*member)) - reinterpret_cast<const char *>(&probe)) /
+               sizeof(float);
+    }
+
+    void LoadLane(std::size_t lane, const T &item) noexcept
+    {
+        auto f = reinterpret_cast<const float *>(&item);
+        for (std::size_t j = 0; j < FLOATS; ++j)
+        {
+            data[j][lane] = f[j];
+        }
+    }
+};
+
+template<typename T>
+void Packet<T>::Load(const T *items, std::size_t count) noexcept
+{
+    for (std::size_t lane = 0; lane < PACKET_SIZE; ++lane)
+    {
+        LoadLane(lane, items[std::min(lane, count - 1)]);
+    }
+}
+
+template<typename T>
+void Packet<T>::Load(const T *items, const unsigned *indices, std::size_t count) noexcept
+{
+    for (std::size_t lane = 0; lane < PACKET_SIZE; ++lane)
+    {
+        LoadLane(lane, items[indices[std::min(lane, count - 1)]]);
+    }
+}
+
+template<typename T>
+void Packet<T>::Store(T *items, std::size_t count) const noexcept
+{
+    for (std::size_t lane = 0; lane < count; ++lane)
+    {
+        auto f = reinterpret_cast<float *>(&items[lane]);
+        for (std::size_t j = 0; j < FLOATS; ++j)
+        {
+            f[j] = data[j][lane];
+        }
+    }
+}
+
+// Coarse screen-space derivatives of a value over a fragment packet: one pair per quad, the
+// differences towards the right and the lower neighbour of the quad's top-left pixel
+inline void QuadDerivatives(const float *v, float *ddx, float *ddy) noexcept
+{
+    for (std::size_t quad = 0; quad < PACKET_SIZE; quad += QUAD_SIZE)
+    {
+        float dx = v[quad + 1] - v[quad];
+        float dy = v[quad + 2] - v[quad];
+        for (std::size_t lane = quad; lane < quad + QUAD_SIZE; ++lane)
+        {
+            ddx[lane] = dx;
+            ddy[lane] = dy;
+        }
+    }
+}
+
+// out[r] = row r of m * (x, y, z, 1) for every lane
+inline void TransformPoints(const Mat4f &m, const float *x, const float *y, const float *z,
+                            float *const out[4]) noexcept
+{
+    for (int r = 0; r < 4; ++r)
+    {
+        const float *row = m[r];
+        float *o = out[r];
+        for (std::size_t lane = 0; lane < PACKET_SIZE; ++lane)
+        {
+            o[lane] = row[0] * x[lane] + row[1] * y[lane] + row[2] * z[lane] + row[3];
+        }
+    }
+}
+
+}
+
+#endif //PACKET_HPP
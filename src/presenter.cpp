@@ -0,0 +1,271 @@
+//
+// Presentation backends.
+//
+
+#include "presenter.hpp"
+#include <fstream>
+#include <vector>
+#include <stdexcept>
+#include <utility>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fb.h>
+
+namespace rst
+{
+
+FbdevPresenter::FbdevPresenter(const std::string &device):
+    m_memory{nullptr},
+    m_size{0},
+    m_lineLength{0},
+    m_width{0},
+    m_height{0}
+{
+    int fd = open(device.c_str(), O_RDWR);
+    if (fd < 0)
+    {
+        std::perror(("open " + device).c_str());
+        return;
+    }
+
+    fb_fix_screeninfo fixInfo{};
+    fb_var_screeninfo varInfo{};
+    struct stat st{};
+    if (ioctl(fd, FBIOGET_FSCREENINFO, &fixInfo) == 0 && ioctl(fd, FBIOGET_VSCREENINFO, &varInfo) == 0)
+    {
+        m_size = fixInfo.smem_len;
+        m_lineLength = fixInfo.line_length;
+        m_width = varInfo.xres;
+        m_height = varInfo.yres;
+        if (varInfo.bits_per_pixel != 8 * sizeof(Color))
+        {
+            std::fprintf(stderr, "%s: %u bits per pixel, expected %zu\n", device.c_str(),
+                         varInfo.bits_per_pixel, 8 * sizeof(Color));
+        }
+    }
+    else if (fstat(fd, &st) == 0)
+    {
+        m_size = st.st_size;
+    }
+
+    void *memory = m_size > 0 ? mmap(nullptr, m_size, PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (memory == MAP_FAILED)
+    {
+        std::perror(("mmap " + device).c_str());
+        m_size = 0;
+    }
+    else
+    {
+        m_memory = static_cast<char *>(memory);
+    }
+    close(fd);
+}
+
+FbdevPresenter::~FbdevPresenter()
+{
+    if (m_memory)
+    {
+        munmap(m_memory, m_size);
+    }
+}
+
+bool FbdevPresenter::GetNativeSize(int &width, int &height) const
+{
+    if (m_width == 0 || m_height == 0)
+    {
+        return false;
+    }
+    width = m_width;
+    height = m_height;
+    return true;
+}
+
+void FbdevPresenter::Present(const FrameBuffer &frameBuffer)
+{
+    if (!m_memory)
+    {
+        return;
+    }
+
+    const Color *pixels = frameBuffer;
+    int srcWidth = frameBuffer.GetWidth();
+    int srcHeight = frameBuffer.GetHeight();
+    int width = m_width > 0 ? m_width : srcWidth;
+    int height = m_height > 0 ? m_height : srcHeight;
+    std::size_t lineLength = m_lineLength > 0 ? m_lineLength : sizeof(Color) * srcWidth;
+    width = std::min<std::size_t>(width, lineLength / sizeof(Color));
+    height = std::min<std::size_t>(height, m_size / lineLength);
+
+    if (srcWidth == width && srcHeight == height)
+    {
+        for (int y = 0; y < height; ++y)
+        {
+            std::memcpy(m_memory + lineLength * y, pixels + srcWidth * y, sizeof(Color) * width);
+        }
+        return;
+    }
+
+    m_columns.resize(width);
+    for (int x = 0; x < width; ++x)
+    {
+        m_columns[x] = x * srcWidth / width;
+    }
+    for (int y = 0; y < height; ++y)
+    {
+        auto src = pixels + srcWidth * (y * srcHeight / height);
+        auto dst = reinterpret_cast<Color *>(m_memory + lineLength * y);
+        for (int x = 0; x < width; ++x)
+        {
+            dst[x] = src[m_columns[x]];
+        }
+    }
+}
+
+AsyncPresenter::AsyncPresenter(std::unique_ptr<Presenter> presenter):
+    m_presenter{std::move(presenter)},
+    m_pending{nullptr},
+    m_shouldStop{false},
+    m_thread{[this] { this->Run(); }}
+{
+}
+
+AsyncPresenter::~AsyncPresenter()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this] { return m_pending == nullptr; });
+        m_shouldStop = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+}
+
+void AsyncPresenter::Present(const FrameBuffer &frameBuffer)
+{
+    Wait();
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_pending = &frameBuffer;
+    }
+    m_condition.notify_all();
+}
+
+void AsyncPresenter::Wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_condition.wait(lock, [this] { return m_pending == nullptr; });
+    if (m_error)
+    {
+        std::rethrow_exception(std::exchange(m_error, nullptr));
+    }
+}
+
+bool AsyncPresenter::GetNativeSize(int &width, int &height) const
+{
+    return m_presenter->GetNativeSize(width, height);
+}
+
+void AsyncPresenter::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_condition.wait(lock, [this] { return m_pending != nullptr || m_shouldStop; });
+        if (m_shouldStop)
+        {
+            return;
+        }
+
+        // the frame stays pending while it is copied, so the renderer cannot reuse it
+        lock.unlock();
+        try
+        {
+            m_presenter->Present(*m_pending);
+            m_presenter->Wait();
+        }
+        catch (...)
+        {
+            lock.lock();
+            m_error = std::current_exception();
+            lock.unlock();
+        }
+        lock.lock();
+        m_pending = nullptr;
+        m_condition.notify_all();
+    }
+}
+
+PpmPresenter::PpmPresenter(std::string prefix):
+    m_prefix{std::move(prefix)},
+    m_frames{0}
+{
+}
+
+void PpmPresenter::Present(const FrameBuffer &frameBuffer)
+{
+    char number[16];
+    std::snprintf(number, sizeof(number), "%05zu", m_frames++);
+    WritePpm(frameBuffer, m_prefix + number + ".ppm");
+}
+
+void WritePpm(const FrameBuffer &frameBuffer, const std::string &filename)
+{
+    std::ofstream out{filename, std::ios::binary};
+    if (!out.is_open())
+    {
+        throw std::runtime_error("Failed to open " + filename);
+    }
+
+    int width = frameBuffer.GetWidth();
+    int height = frameBuffer.GetHeight();
+    out << "P6\n" << width << " " << height << "\n255\n";
+    // the buffer is stored top row first, like the fbdev memory
+    const Color *pixels = frameBuffer;
+    std::vector<char> row(3 * width);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            auto &color = pixels[width * y + x];
+            row[3 * x] = color.r;
+            row[3 * x + 1] = color.g;
+            row[3 * x + 2] = color.b;
+        }
+        out.write(row.data(), row.size());
+    }
+    if (!out)
+    {
+        throw std::runtime_error("Failed to write " + filename);
+    }
+}
+
+std::unique_ptr<Presenter> MakePresenter(const std::string &spec)
+{
+    auto colon = spec.find(':');
+    auto name = spec.substr(0, colon);
+    auto argument = colon == std::string::npos ? std::string{} : spec.substr(colon + 1);
+
+    if (name == "fbdev")
+    {
+        return std::make_unique<AsyncPresenter>(argument.empty() ? std::make_unique<FbdevPresenter>()
+                                                                 : std::make_unique<FbdevPresenter>(argument));
+    }
+    if (name == "headless")
+    {
+        return std::make_unique<HeadlessPresenter>();
+    }
+    if (name == "ppm" && !argument.empty())
+    {
+        return std::make_unique<PpmPresenter>(argument);
+    }
+
+    throw std::runtime_error("Unknown presenter " + spec);
+}
+
+}
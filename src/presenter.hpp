@@ -0,0 +1,103 @@
+//
+// Presentation backends: where a finished frame goes.
+//
+
+#ifndef PRESENTER_HPP
+#define PRESENTER_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "tty_context.hpp"
+
+namespace rst
+{
+
+// Present may return before the frame is consumed. The frame must stay untouched until the next
+// Present or Wait returns, so the caller alternates between two buffers.
+class Presenter
+{
+public:
+    virtual      ~Presenter() = default;
+    virtual void Present(const FrameBuffer &frameBuffer) = 0;
+    // Blocks until the last presented frame is consumed
+    virtual void Wait() {}
+    // Resolution of the output device, if it has one
+    virtual bool GetNativeSize(int &/*width*/, int &/*height*/) const { return false; }
+};
+
+// Linux framebuffer device, mapped once. Rows are copied with the line length of the device,
+// frames of another resolution are scaled to the screen with nearest-neighbour sampling.
+// Regular files work too, they are treated as a packed frame of the rendered size.
+class FbdevPresenter : public Presenter
+{
+public:
+    explicit FbdevPresenter(const std::string &device = "/dev/fb0");
+             FbdevPresenter(const FbdevPresenter &) = delete;
+    FbdevPresenter &operator=(const FbdevPresenter &) = delete;
+             ~FbdevPresenter() override;
+    void     Present(const FrameBuffer &frameBuffer) override;
+    bool     GetNativeSize(int &width, int &height) const override;
+private:
+    char             *m_memory;
+    std::size_t      m_size;
+    std::size_t      m_lineLength; // 0 if unknown
+    int              m_width;      // 0 if unknown
+    int              m_height;
+    std::vector<int> m_columns;    // source column of every screen column when scaling
+};
+
+// Runs another presenter on a dedicated thread, so the next frame is rendered while this one is copied
+class AsyncPresenter : public Presenter
+{
+public:
+    explicit AsyncPresenter(std::unique_ptr<Presenter> presenter);
+             ~AsyncPresenter() override;
+    void     Present(const FrameBuffer &frameBuffer) override;
+    void     Wait() override;
+    bool     GetNativeSize(int &width, int &height) const override;
+private:
+    std::unique_ptr<Presenter> m_presenter;
+    const FrameBuffer          *m_pending;
+    bool                       m_shouldStop;
+    std::exception_ptr         m_error;
+    std::mutex                 m_mutex;
+    std::condition_variable    m_condition;
+    std::thread                m_thread;
+
+    void Run();
+};
+
+// Keeps the frame in memory only, for benchmarks and machines without a framebuffer
+class HeadlessPresenter : public Presenter
+{
+public:
+    void        Present(const FrameBuffer &/*frameBuffer*/) override { ++m_frames; }
+    std::size_t GetFrameCount() const noexcept { return m_frames; }
+private:
+    std::size_t m_frames{0};
+};
+
+// Writes every frame to <prefix>NNNNN.ppm, for byte-for-byte comparisons
+class PpmPresenter : public Presenter
+{
+public:
+    explicit PpmPresenter(std::string prefix);
+    void     Present(const FrameBuffer &frameBuffer) override;
+private:
+    std::string m_prefix;
+    std::size_t m_frames;
+};
+
+void WritePpm(const FrameBuffer &frameBuffer, const std::string &filename);
+
+// "fbdev[:device]", "headless" or "ppm:prefix"; the framebuffer is presented asynchronously
+std::unique_ptr<Presenter> MakePresenter(const std::string &spec);
+
+}
+
+#endif //PRESENTER_HPP
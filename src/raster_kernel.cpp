@@ -0,0 +1,474 @@
+//
+// Half-space rasterization kernels with runtime CPU dispatch.
+//
+
+#include "raster_kernel.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <immintrin.h>
+
+namespace rst
+{
+
+namespace
+{
+
+constexpr int   B{RASTER_BLOCK_SIZE};
+// slack for the difference between depth evaluated at block corners and at pixels
+constexpr float DEPTH_EPS{1e-6f};
+
+// Affine function f0 + fx * x + fy * y of the pixel coordinates
+struct Plane
+{
+    float f0, fx, fy;
+
+    // the extremes over a rectangle are reached at its corners
+    void Range(int x0, int y0, int x1, int y1, float &min, float &max) const noexcept
+    {
+        float lx = fx * x0, hx = fx * x1;
+        float ly = fy * y0, hy = fy * y1;
+        min = f0 + std::min(lx, hx) + std::min(ly, hy);
+        max = f0 + std::max(lx, hx) + std::max(ly, hy);
+    }
+
+    // Every kernel takes the depth of a pixel as fma(fx, dx, fma(fy, dy, At(blockX, blockY))), dx and dy
+    // being its offset in the block, lane by lane when vectorized, so the dispatched kernel cannot change
+    // a bit of the output
+    float At(int x, int y) const noexcept
+    {
+        return std::fma(fx, static_cast<float>(x), std::fma(fy, static_cast<float>(y), f0));
+    }
+};
+
+// An edge function of RasterSetup
+struct Edge
+{
+    std::int64_t e0, ex, ey;
+
+    void Range(int x0, int y0, int x1, int y1, std::int64_t &min, std::int64_t &max) const noexcept
+    {
+        std::int64_t lx = ex * x0, hx = ex * x1;
+        std::int64_t ly = ey * y0, hy = ey * y1;
+        min = e0 + std::min(lx, hx) + std::min(ly, hy);
+        max = e0 + std::max(lx, hx) + std::max(ly, hy);
+    }
+
+    // The value at a pixel, clamped to +-EDGE_LIMIT. The steps to the other pixels of its block are
+    // below EDGE_LIMIT (see SetupTriangle), so stepping from the clamped value gives the right signs.
+    std::int32_t At(int x, int y) const noexcept
+    {
+        constexpr std::int64_t limit = EDGE_LIMIT;
+        return static_cast<std::int32_t>(std::clamp(e0 + ex * x + ey * y, -limit, limit));
+    }
+};
+
+struct TrianglePlanes
+{
+    Edge  edges[3];
+    Plane z;
+
+    explicit TrianglePlanes(const RasterSetup &s) noexcept:
+        edges{{s.e0[0], s.ex[0], s.ey[0]}, {s.e0[1], s.ex[1], s.ey[1]}, {s.e0[2], s.ex[2], s.ey[2]}},
+        z{s.z0, s.zx, s.zy} {}
+};
+
+enum class BlockCoverage
+{
+    Outside,
+    Partial,
+    Inside
+};
+
+// Classifies the part [x0, x1] x [y0, y1] of a block against the edges and the block's stored depth range.
+// depthPasses is set when every pixel of the triangle in the block is in front of the stored depth.
+inline BlockCoverage ClassifyBlock(const TrianglePlanes &p, const DepthTarget &t,
+                                   int x0, int y0, int x1, int y1, bool &depthPasses) noexcept
+{
+    bool inside = true;
+    for (auto &edge : p.edges)
+    {
+        std::int64_t min, max;
+        edge.Range(x0, y0, x1, y1, min, max);
+        if (max < 0)
+        {
+            return BlockCoverage::Outside;
+        }
+        inside = inside && min >= 0;
+    }
+
+    float zMin, zMax;
+    auto block = t.blockPitch * (y0 / B) + x0 / B;
+    p.z.Range(x0, y0, x1, y1, zMin, zMax);
+    if (zMin - DEPTH_EPS > t.blockMax[block])
+    {
+        return BlockCoverage::Outside;
+    }
+    depthPasses = zMax + DEPTH_EPS <= t.blockMin[block];
+
+    return inside ? BlockCoverage::Inside : BlockCoverage::Partial;
+}
+
+inline float *DepthRow(const DepthTarget &t, int x, int y) noexcept
+{
+    return t.depth + t.depthPitch * y + x;
+}
+
+}
+
+RasterKernel GetRasterKernel() noexcept
+{
+    static const RasterKernel kernel = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            return &RasterizeRectAvx512;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            return &RasterizeRectAvx2;
+        }
+        return &RasterizeRectScalar;
+    }();
+
+    return kernel;
+}
+
+std::size_t RasterizeRectScalar(const RasterSetup &s, const DepthTarget &t,
+                                int minX, int minY, int maxX, int maxY, RasterFragment *out) noexcept
+{
+    TrianglePlanes planes{s};
+
+    std::size_t count = 0;
+    for (int blockY = minY & ~(B - 1); blockY <= maxY; blockY += B)
+    {
+        int y0 = std::max(minY, blockY);
+        int y1 = std::min(maxY, blockY + B - 1);
+        for (int blockX = minX & ~(B - 1); blockX <= maxX; blockX += B)
+        {
+            int x0 = std::max(minX, blockX);
+            int x1 = std::min(maxX, blockX + B - 1);
+            bool depthPasses = false;
+            auto coverage = ClassifyBlock(planes, t, x0, y0, x1, y1, depthPasses);
+            if (coverage == BlockCoverage::Outside)
+            {
+                continue;
+            }
+
+            std::int32_t origin[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                origin[k] = planes.edges[k].At(x0, y0);
+            }
+            float blockZ = planes.z.At(blockX, blockY);
+
+            float writtenMin = std::numeric_limits<float>::infinity();
+            for (int y = y0; y <= y1; ++y)
+            {
+                float rowZ = std::fma(s.zy, static_cast<float>(y - blockY), blockZ);
+                float *depthRow = DepthRow(t, 0, y);
+                std::int32_t e[3];
+                for (int k = 0; k < 3; ++k)
+                {
+                    e[k] = origin[k] + s.ey[k] * (y - y0);
+                }
+                for (int x = x0; x <= x1; ++x, e[0] += s.ex[0], e[1] += s.ex[1], e[2] += s.ex[2])
+                {
+                    if (coverage == BlockCoverage::Partial && (e[0] | e[1] | e[2]) < 0)
+                    {
+                        continue;
+                    }
+
+                    float depth = std::fma(s.zx, static_cast<float>(x - blockX), rowZ);
+                    if (!depthPasses && !(depth <= depthRow[x]))
+                    {
+                        continue;
+                    }
+                    depthRow[x] = depth;
+                    writtenMin = std::min(writtenMin, depth);
+                    out[count++] = RasterFragment{x, y, depth};
+                }
+            }
+
+            if (writtenMin != std::numeric_limits<float>::infinity())
+            {
+                auto block = t.blockPitch * (blockY / B) + blockX / B;
+                float blockMax = -std::numeric_limits<float>::infinity();
+                for (int y = blockY; y < blockY + B; ++y)
+                {
+                    float *depthRow = DepthRow(t, blockX, y);
+                    blockMax = std::max(blockMax, *std::max_element(depthRow, depthRow + B));
+                }
+                t.blockMin[block] = std::min(t.blockMin[block], writtenMin);
+                t.blockMax[block] = blockMax;
+            }
+        }
+    }
+
+    return count;
+}
+
+namespace
+{
+
+__attribute__((target("avx2,fma")))
+inline float HorizontalMin(__m256 v) noexcept
+{
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+__attribute__((target("avx2,fma")))
+inline float HorizontalMax(__m256 v) noexcept
+{
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+}
+
+// One 8-wide vector per block row
+__attribute__((target("avx2,fma")))
+std::size_t RasterizeRectAvx2(const RasterSetup &s, const DepthTarget &t,
+                              int minX, int minY, int maxX, int maxY, RasterFragment *out) noexcept
+{
+    constexpr int W = 8;
+    static_assert(B == W, "a block row must fill one vector");
+    TrianglePlanes planes{s};
+    const __m256 iota = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    // the edge functions at the lanes of a block row, relative to the first lane
+    __m256i edgeLanes[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        edgeLanes[k] = _mm256_mullo_epi32(_mm256_set1_epi32(s.ex[k]), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    }
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    const __m256 zx  = _mm256_set1_ps(s.zx);
+    const __m256 zy  = _mm256_set1_ps(s.zy);
+    alignas(32) float depth[W];
+
+    std::size_t count = 0;
+    for (int blockY = minY & ~(B - 1); blockY <= maxY; blockY += B)
+    {
+        int y0 = std::max(minY, blockY);
+        int y1 = std::min(maxY, blockY + B - 1);
+        for (int x = minX & ~(B - 1); x <= maxX; x += B)
+        {
+            int x0 = std::max(minX, x);
+            int x1 = std::min(maxX, x + B - 1);
+            bool depthPasses = false;
+            auto coverage = ClassifyBlock(planes, t, x0, y0, x1, y1, depthPasses);
+            if (coverage == BlockCoverage::Outside)
+            {
+                continue;
+            }
+
+            unsigned valid = ((1u << (x1 - x + 1)) - 1) & ~((1u << (x0 - x)) - 1);
+            __m256 blockZ = _mm256_set1_ps(planes.z.At(x, blockY));
+            __m256i origin[3];
+            if (coverage == BlockCoverage::Partial)
+            {
+                for (int k = 0; k < 3; ++k)
+                {
+                    origin[k] = _mm256_add_epi32(_mm256_set1_epi32(planes.edges[k].At(x, y0)), edgeLanes[k]);
+                }
+            }
+            __m256 written = inf;
+            bool anyWritten = false;
+            for (int y = y0; y <= y1; ++y)
+            {
+                unsigned mask = valid;
+                if (coverage == BlockCoverage::Partial)
+                {
+                    // a lane is covered if the sign bits of its edge functions are clear
+                    __m256i e = _mm256_setzero_si256();
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        e = _mm256_or_si256(e, _mm256_add_epi32(origin[k], _mm256_set1_epi32(s.ey[k] * (y - y0))));
+                    }
+                    mask &= ~_mm256_movemask_ps(_mm256_castsi256_ps(e));
+                    if (!mask)
+                    {
+                        continue;
+                    }
+                }
+
+                __m256 rowZ = _mm256_fmadd_ps(zy, _mm256_set1_ps(static_cast<float>(y - blockY)), blockZ);
+                __m256 z = _mm256_fmadd_ps(zx, iota, rowZ);
+                float *depthRow = DepthRow(t, x, y);
+                __m256 stored = _mm256_loadu_ps(depthRow);
+                if (!depthPasses)
+                {
+                    mask &= _mm256_movemask_ps(_mm256_cmp_ps(z, stored, _CMP_LE_OQ));
+                    if (!mask)
+                    {
+                        continue;
+                    }
+                }
+
+                __m256i m = _mm256_and_si256(_mm256_set1_epi32(mask), laneBits);
+                __m256 lanes = _mm256_castsi256_ps(_mm256_cmpeq_epi32(m, laneBits));
+                _mm256_storeu_ps(depthRow, _mm256_blendv_ps(stored, z, lanes));
+                written = _mm256_min_ps(written, _mm256_blendv_ps(inf, z, lanes));
+                anyWritten = true;
+
+                _mm256_store_ps(depth, z);
+
+                for (; mask; mask &= mask - 1)
+                {
+                    int lane = __builtin_ctz(mask);
+                    out[count++] = RasterFragment{x + lane, y, depth[lane]};
+                }
+            }
+
+            if (anyWritten)
+            {
+                auto block = t.blockPitch * (blockY / B) + x / B;
+                __m256 blockMax = _mm256_loadu_ps(DepthRow(t, x, blockY));
+                for (int y = blockY + 1; y < blockY + B; ++y)
+                {
+                    blockMax = _mm256_max_ps(blockMax, _mm256_loadu_ps(DepthRow(t, x, y)));
+                }
+                t.blockMin[block] = std::min(t.blockMin[block], HorizontalMin(written));
+                t.blockMax[block] = HorizontalMax(blockMax);
+            }
+        }
+    }
+
+    return count;
+}
+
+namespace
+{
+
+__attribute__((target("avx512f")))
+inline __m512 LoadRows(const float *lo, const float *hi) noexcept
+{
+    __m512d v = _mm512_castpd256_pd512(_mm256_castps_pd(_mm256_loadu_ps(lo)));
+    return _mm512_castpd_ps(_mm512_insertf64x4(v, _mm256_castps_pd(_mm256_loadu_ps(hi)), 1));
+}
+
+}
+
+// Two block rows per 16-wide vector
+__attribute__((target("avx512f")))
+std::size_t RasterizeRectAvx512(const RasterSetup &s, const DepthTarget &t,
+                                int minX, int minY, int maxX, int maxY, RasterFragment *out) noexcept
+{
+    constexpr int W = 16;
+    static_assert(2 * B == W, "two block rows must fill one vector");
+    TrianglePlanes planes{s};
+    const __m512 laneX = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7);
+    const __m512 laneY = _mm512_setr_ps(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+    // the edge functions at the lanes of two block rows, relative to the first lane
+    __m512i edgeLanes[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        edgeLanes[k] = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_set1_epi32(s.ex[k]), _mm512_cvttps_epi32(laneX)),
+                                        _mm512_mullo_epi32(_mm512_set1_epi32(s.ey[k]), _mm512_cvttps_epi32(laneY)));
+    }
+    const __m512 inf = _mm512_set1_ps(std::numeric_limits<float>::infinity());
+    const __m512 zx  = _mm512_set1_ps(s.zx);
+    const __m512 zy  = _mm512_set1_ps(s.zy);
+    alignas(64) float depth[W];
+
+    std::size_t count = 0;
+    for (int blockY = minY & ~(B - 1); blockY <= maxY; blockY += B)
+    {
+        int y0 = std::max(minY, blockY);
+        int y1 = std::min(maxY, blockY + B - 1);
+        for (int x = minX & ~(B - 1); x <= maxX; x += B)
+        {
+            int x0 = std::max(minX, x);
+            int x1 = std::min(maxX, x + B - 1);
+            bool depthPasses = false;
+            auto coverage = ClassifyBlock(planes, t, x0, y0, x1, y1, depthPasses);
+            if (coverage == BlockCoverage::Outside)
+            {
+                continue;
+            }
+
+            unsigned rowValid = ((1u << (x1 - x + 1)) - 1) & ~((1u << (x0 - x)) - 1);
+            __m512 blockZ = _mm512_set1_ps(planes.z.At(x, blockY));
+            __m512i origin[3];
+            if (coverage == BlockCoverage::Partial)
+            {
+                for (int k = 0; k < 3; ++k)
+                {
+                    origin[k] = _mm512_add_epi32(_mm512_set1_epi32(planes.edges[k].At(x, y0)), edgeLanes[k]);
+                }
+            }
+            __m512 written = inf;
+            for (int y = y0; y <= y1; y += 2)
+            {
+                // the second row may lie past the block when the rectangle has an odd number of rows
+                bool twoRows = y < y1;
+                __mmask16 mask = twoRows ? rowValid | rowValid << B : rowValid;
+                if (coverage == BlockCoverage::Partial)
+                {
+                    __m512i e = _mm512_setzero_si512();
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        e = _mm512_or_si512(e, _mm512_add_epi32(origin[k], _mm512_set1_epi32(s.ey[k] * (y - y0))));
+                    }
+                    mask = _mm512_mask_cmpge_epi32_mask(mask, e, _mm512_setzero_si512());
+                    if (!mask)
+                    {
+                        continue;
+                    }
+                }
+
+                __m512 ys = _mm512_add_ps(_mm512_set1_ps(static_cast<float>(y - blockY)), laneY);
+                __m512 z = _mm512_fmadd_ps(zx, laneX, _mm512_fmadd_ps(zy, ys, blockZ));
+                float *lo = DepthRow(t, x, y);
+                float *hi = twoRows ? DepthRow(t, x, y + 1) : lo;
+                __m512 stored = LoadRows(lo, hi);
+                if (!depthPasses)
+                {
+                    mask = _mm512_mask_cmp_ps_mask(mask, z, stored, _CMP_LE_OQ);
+                    if (!mask)
+                    {
+                        continue;
+                    }
+                }
+
+                __m512 merged = _mm512_mask_blend_ps(mask, stored, z);
+                _mm256_storeu_ps(lo, _mm512_castps512_ps256(merged));
+                if (twoRows)
+                {
+                    _mm256_storeu_ps(hi, _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(merged), 1)));
+                }
+                written = _mm512_mask_min_ps(written, mask, written, z);
+                _mm512_store_ps(depth, z);
+
+                for (unsigned bits = mask; bits; bits &= bits - 1)
+                {
+                    int lane = __builtin_ctz(bits);
+                    out[count++] = RasterFragment{x + lane % B, y + lane / B, depth[lane]};
+                }
+            }
+
+            float writtenMin = _mm512_reduce_min_ps(written);
+            if (writtenMin != std::numeric_limits<float>::infinity())
+            {
+                auto block = t.blockPitch * (blockY / B) + x / B;
+                __m512 blockMax = LoadRows(DepthRow(t, x, blockY), DepthRow(t, x, blockY + 1));
+                for (int y = blockY + 2; y < blockY + B; y += 2)
+                {
+                    blockMax = _mm512_max_ps(blockMax, LoadRows(DepthRow(t, x, y), DepthRow(t, x, y + 1)));
+                }
+                t.blockMin[block] = std::min(t.blockMin[block], writtenMin);
+                t.blockMax[block] = _mm512_reduce_max_ps(blockMax);
+            }
+        }
+    }
+
+    return count;
+}
+
+}
@@ -0,0 +1,76 @@
+//
+// Half-space rasterization kernels with runtime CPU dispatch.
+//
+
+#ifndef RASTER_KERNEL_HPP
+#define RASTER_KERNEL_HPP
+
+#include "hiz_buffer.hpp"
+#include <cstddef>
+#include <cstdint>
+
+namespace rst
+{
+
+// Vertices are snapped to 1 / (1 << SUBPIXEL_BITS) of a pixel before setup
+constexpr int SUBPIXEL_BITS{8};
+
+// Within a block the kernels step the edge functions in 32 bits, starting from their value at one pixel
+// clamped to +-EDGE_LIMIT. The steps across a block must stay below EDGE_LIMIT to keep the signs right.
+constexpr std::int32_t EDGE_LIMIT{1 << 30};
+
+// Triangle setup in pixel coordinates. Barycentrics of the second and third vertex and depth are affine
+// functions f(x, y) = f0 + fx * x + fy * y evaluated at pixel centers.
+// Coverage is decided by the exact edge functions of the snapped vertices instead: edge k, opposite
+// vertex k, is e0 + ex * x + ey * y at the pixel centers, and a pixel is covered if none is negative.
+// The top-left rule is folded into e0, so a pixel on an edge shared by two triangles is covered once.
+struct RasterSetup
+{
+    std::int64_t e0[3];
+    std::int32_t ex[3];
+    std::int32_t ey[3];
+    float b0, bx, by;
+    float c0, cx, cy;
+    float z0, zx, zy;
+    float z[3];   // at the vertices
+};
+
+struct RasterFragment
+{
+    int   x;
+    int   y;
+    float depth;
+};
+
+// Depth buffer and its hierarchical min/max, addressed by pixel and block coordinates
+struct DepthTarget
+{
+    float          *depth;      // pixel (0, 0)
+    std::ptrdiff_t depthPitch;  // from a row to the next one
+    float          *blockMin;   // block (0, 0)
+    float          *blockMax;
+    std::ptrdiff_t blockPitch;
+};
+
+// The rectangle is walked in the 8x8 blocks of the HiZBuffer. Blocks entirely outside the triangle or
+// behind the stored depth are skipped, blocks entirely inside it are emitted without per-pixel edge tests.
+// The rectangle must not cross a tile border, so every block it touches is owned by the caller.
+constexpr int RASTER_BLOCK_SIZE{HIZ_BLOCK_SIZE};
+
+// Depth-tests every covered pixel of the inclusive rectangle, writes the passing depths to the target
+// and the passing pixels to out, and returns their number. out must have room for the whole rectangle.
+using RasterKernel = std::size_t (*)(const RasterSetup &setup, const DepthTarget &target,
+                                     int minX, int minY, int maxX, int maxY, RasterFragment *out);
+
+RasterKernel GetRasterKernel() noexcept;
+
+std::size_t RasterizeRectScalar(const RasterSetup &setup, const DepthTarget &target,
+                                int minX, int minY, int maxX, int maxY, RasterFragment *out) noexcept;
+std::size_t RasterizeRectAvx2(const RasterSetup &setup, const DepthTarget &target,
+                              int minX, int minY, int maxX, int maxY, RasterFragment *out) noexcept;
+std::size_t RasterizeRectAvx512(const RasterSetup &setup, const DepthTarget &target,
+                                int minX, int minY, int maxX, int maxY, RasterFragment *out) noexcept;
+
+}
+
+#endif //RASTER_KERNEL_HPP
@@ -25,50 +25,82 @@ public:
     using FsIn  = typename FShader::InType;
 
     static constexpr std::size_t VERTEX_BATCH_SIZE{2048};
-    static constexpr std::size_t RASTER_TRI_BATCH_SIZE{2048};
-    static constexpr std::size_t FRAGMENT_BATCH_SIZE{2048};
+    static constexpr std::size_t BIN_TRI_BATCH_SIZE{2048};
+    static constexpr std::size_t MESHLET_BATCH_SIZE{16};
 
          Rasterizer(TtyContext &context, VShader &vs, FShader &fs,
                     std::size_t threads = 1)                        noexcept;
     void RasterizeVertexArray(const std::vector<VsIn> &vertices,
                               const std::vector<unsigned> &indices) noexcept;
+    // Raw arrays, e.g. a MappedMesh
+    void RasterizeVertexArray(const VsIn *vertices, std::size_t vertexCount,
+                              const unsigned *indices, std::size_t indexCount) noexcept;
+    // Skips the draw without shading a vertex if the bounds of the vertex positions are outside
+    // the view frustum. Needs a vertex shader with a projection member, see HasProjection.
+    void RasterizeVertexArray(const VsIn *vertices, std::size_t vertexCount,
+                              const unsigned *indices, std::size_t indexCount, const Aabb &bounds) noexcept;
+    // Shades and bins only the meshlets passing MeshletCuller. Needs a vertex shader with a projection member.
+    void RasterizeMeshlets(const VsIn *vertices, const Mesh::Meshlet *meshlets, std::size_t meshletCount,
+                           const unsigned *meshletVertices, const std::uint8_t *meshletTriangles) noexcept;
+    // Takes the meshlet path if the mesh has meshlets
+    void RasterizeMesh(const Mesh &mesh)                            noexcept;
+    void RasterizeMesh(const MappedMesh &mesh)                      noexcept;
+    void SetShadingMode(ShadingMode mode)                           noexcept { m_shadingMode = mode; }
 private:
     using VbTask = VertexBatchTask<VShader>;
     using VbTaskParams = typename VbTask::ThreadParams;
-    using RastTask = RasterBatchTask<VShader>;
-    using RastTaskParams = typename RastTask::ThreadParams;
-    using FragTask = FragBatchTask<typename RastTask::Output, FShader>;
-    using FragTaskParams = typename FragTask::ThreadParams;
+    using BinTask = BinBatchTask<VShader>;
+    using BinTaskParams = typename BinTask::ThreadParams;
+    using MeshletTask = MeshletBatchTask<VShader>;
+    using MeshletTaskParams = typename MeshletTask::ThreadParams;
+    using TileTask = TileRenderTask<VShader, FShader>;
+    using TileTaskParams = typename TileTask::ThreadParams;
 
     TtyContext  &m_context;
-    FrameBuffer &m_frameBuf;
     DepthBuffer &m_depthBuf;
     VShader     &m_vertexShader;
     FShader     &m_fragmentShader;
-    std::size_t m_threads;
+    ThreadPool  m_pool;
     Culling     m_culling;
+    ShadingMode m_shadingMode;
+    TileGrid    m_grid;
 
     std::vector<VsOut> m_vsOutput;
     std::vector<VbTaskParams> m_vbTaskParams;
-    std::vector<RastTaskParams> m_rastTaskParams;
-    std::vector<FragTaskParams> m_fragTaskParams;
+    std::vector<BinTaskParams> m_binTaskParams;
+    std::vector<MeshletTaskParams> m_meshletTaskParams;
+    std::vector<TileTaskParams> m_tileTaskParams;
+
+    void BeginDraw() noexcept;
+    // Renders the binned triangles and empties the bins
+    void RenderTiles() noexcept;
 };
 
 template<typename VShader, typename FShader>
 Rasterizer<VShader, FShader>::Rasterizer(TtyContext &context, VShader &vs, FShader &fs, std::size_t threads) noexcept:
     m_context{context},
-    m_frameBuf{context.GetFrameBuffer()},
     m_depthBuf{context.GetDepthBuffer()},
     m_vertexShader{vs},
     m_fragmentShader{fs},
-    m_threads{threads},
-    m_culling{Culling::Ccw}
+    m_pool{threads},
+    m_culling{Culling::Ccw},
+    m_shadingMode{ShadingMode::Forward},
+    m_grid{context.GetWidth(), context.GetHeight(), TileCount(context.GetWidth()), TileCount(context.GetHeight()),
+           context.GetViewport()}
 {
-    for (auto i = 0ul; i < m_threads; ++i)
+    for (auto i = 0ul; i < threads; ++i)
     {
         m_vbTaskParams.emplace_back(VbTaskParams{m_vertexShader, m_vsOutput});
-        m_rastTaskParams.emplace_back(RastTaskParams{m_vsOutput, m_culling, m_frameBuf});
-        m_fragTaskParams.emplace_back(FragTaskParams{m_fragmentShader, m_frameBuf, m_depthBuf, context.GetScreenLock()});
+        m_binTaskParams.emplace_back(BinTaskParams{m_vsOutput, m_culling, m_grid, {},
+                                                   std::vector<std::vector<BinEntry>>(m_grid.tilesX * m_grid.tilesY), 0});
+        m_tileTaskParams.emplace_back(TileTaskParams{m_binTaskParams, m_fragmentShader, m_context,
+                                                     nullptr, m_depthBuf, context.GetHiZBuffer(),
+                                                     m_shadingMode, m_grid, GetRasterKernel(), {}, {}, {}, {}, {}});
+    }
+    // the bin parameters do not move any more
+    for (auto &binParams : m_binTaskParams)
+    {
+        m_meshletTaskParams.emplace_back(MeshletTaskParams{m_vertexShader, binParams, {}});
     }
 }
 
@@ -76,45 +108,132 @@ template<typename VShader, typename FShader>
 void Rasterizer<VShader, FShader>::RasterizeVertexArray(const std::vector<VsIn> &vertices,
                                                         const std::vector<unsigned> &indices) noexcept
 {
-    m_vsOutput.reserve(vertices.size());
-    /*for (auto &param : m_rastTaskParams)
+    RasterizeVertexArray(vertices.data(), vertices.size(), indices.data(), indices.size());
+}
+
+template<typename VShader, typename FShader>
+void Rasterizer<VShader, FShader>::RasterizeVertexArray(const VsIn *vertices, std::size_t vertexCount,
+                                                        const unsigned *indices, std::size_t indexCount,
+                                                        const Aabb &bounds) noexcept
+{
+    static_assert(HasProjection<VShader>::value, "culling by bounds needs the projection of the vertex shader");
+    if (OutsideFrustum(bounds, m_vertexShader.projection))
     {
-        param.output.reserve(1920*1080);
-    }*/
+        return;
+    }
+    RasterizeVertexArray(vertices, vertexCount, indices, indexCount);
+}
+
+template<typename VShader, typename FShader>
+void Rasterizer<VShader, FShader>::RasterizeMesh(const Mesh &mesh) noexcept
+{
+    if (mesh.meshlets.empty())
     {
-        ThreadPool<VbTask> vbPool{m_threads, m_vbTaskParams};
-        for (auto i = 0ul; i < vertices.size(); i += VERTEX_BATCH_SIZE)
-        {
-            auto end = std::min(vertices.size(), i + VERTEX_BATCH_SIZE);
-            vbPool.EnqueueTask(VbTask{&vertices[0], i, end});
-        }
+        RasterizeVertexArray(mesh.vertices.data(), mesh.vertices.size(), mesh.indices.data(), mesh.indices.size(),
+                             mesh.bounds);
     }
+    else if (!OutsideFrustum(mesh.bounds, m_vertexShader.projection))
+    {
+        RasterizeMeshlets(mesh.vertices.data(), mesh.meshlets.data(), mesh.meshlets.size(),
+                          mesh.meshletVertices.data(), mesh.meshletTriangles.data());
+    }
+}
 
+template<typename VShader, typename FShader>
+void Rasterizer<VShader, FShader>::RasterizeMesh(const MappedMesh &mesh) noexcept
+{
+    if (mesh.MeshletCount() == 0)
     {
-        ThreadPool<RastTask> rastPool{m_threads, m_rastTaskParams};
-        for (auto i = 0ul; i < indices.size(); i += RASTER_TRI_BATCH_SIZE * 3)
-        {
-            auto end = std::min(indices.size(), i + RASTER_TRI_BATCH_SIZE * 3);
-            rastPool.EnqueueTask(RastTask{&indices[0], i, end});
-        }
+        RasterizeVertexArray(mesh.Vertices(), mesh.VertexCount(), mesh.Indices(), mesh.IndexCount(), mesh.Bounds());
     }
+    else if (!OutsideFrustum(mesh.Bounds(), m_vertexShader.projection))
+    {
+        RasterizeMeshlets(mesh.Vertices(), mesh.Meshlets(), mesh.MeshletCount(), mesh.MeshletVertices(),
+                          mesh.MeshletTriangles());
+    }
+}
 
+template<typename VShader, typename FShader>
+void Rasterizer<VShader, FShader>::BeginDraw() noexcept
+{
+    m_grid.viewport = m_context.GetViewport();
+    // the context flips between two frame buffers every frame
+    for (auto &params : m_tileTaskParams)
     {
-        ThreadPool<FragTask> fragPool{m_threads, m_fragTaskParams};
-        for (auto &rastOut : m_rastTaskParams)
+        params.frameBuf = &m_context.GetFrameBuffer();
+    }
+}
+
+template<typename VShader, typename FShader>
+void Rasterizer<VShader, FShader>::RasterizeVertexArray(const VsIn *vertices, std::size_t vertexCount,
+                                                        const unsigned *indices, std::size_t indexCount) noexcept
+{
+    BeginDraw();
+
+    m_vsOutput.resize(vertexCount);
+    for (auto i = 0ul; i < vertexCount; i += VERTEX_BATCH_SIZE)
+    {
+        auto end = std::min(vertexCount, i + VERTEX_BATCH_SIZE);
+        m_pool.EnqueueTask(VbTask{vertices, i, end}, m_vbTaskParams);
+    }
+    m_pool.Wait();
+
+    for (auto i = 0ul; i < indexCount; i += BIN_TRI_BATCH_SIZE * 3)
+    {
+        auto end = std::min(indexCount, i + BIN_TRI_BATCH_SIZE * 3);
+        m_pool.EnqueueTask(BinTask{indices, i, end}, m_binTaskParams);
+    }
+    m_pool.Wait();
+
+    RenderTiles();
+}
+
+template<typename VShader, typename FShader>
+void Rasterizer<VShader, FShader>::RasterizeMeshlets(const VsIn *vertices, const Mesh::Meshlet *meshlets,
+                                                     std::size_t meshletCount, const unsigned *meshletVertices,
+                                                     const std::uint8_t *meshletTriangles) noexcept
+{
+    static_assert(HasProjection<VShader>::value, "culling meshlets needs the projection of the vertex shader");
+    BeginDraw();
+
+    // vertex shading and binning are fused, a meshlet's vertices are shaded right before its triangles are binned
+    MeshletCuller culler{m_vertexShader.projection, m_culling};
+    for (auto i = 0ul; i < meshletCount; i += MESHLET_BATCH_SIZE)
+    {
+        auto end = std::min(meshletCount, i + MESHLET_BATCH_SIZE);
+        m_pool.EnqueueTask(MeshletTask{culler, vertices, meshlets, meshletVertices, meshletTriangles, i, end},
+                           m_meshletTaskParams);
+    }
+    m_pool.Wait();
+
+    RenderTiles();
+}
+
+template<typename VShader, typename FShader>
+void Rasterizer<VShader, FShader>::RenderTiles() noexcept
+{
+    for (int ty = 0; ty < m_grid.tilesY; ++ty)
+    {
+        for (int tx = 0; tx < m_grid.tilesX; ++tx)
         {
-            for (auto i = 0ul; i < rastOut.output.size(); i += FRAGMENT_BATCH_SIZE)
+            auto tile = m_grid.tilesX * ty + tx;
+            bool empty = std::all_of(m_binTaskParams.begin(), m_binTaskParams.end(),
+                                     [tile](const BinTaskParams &p) { return p.bins[tile].empty(); });
+            if (!empty)
             {
-                auto end = std::min(rastOut.output.size(), i + FRAGMENT_BATCH_SIZE);
-                fragPool.EnqueueTask(FragTask{&rastOut.output[0], i, end});
+                m_pool.EnqueueTask(TileTask{tx, ty}, m_tileTaskParams);
             }
         }
     }
+    m_pool.Wait();
 
-    m_vsOutput.clear();
-    for (auto &params : m_rastTaskParams)
+    for (auto &params : m_binTaskParams)
     {
-        params.output.clear();
+        params.triangles.clear();
+        for (auto &bin : params.bins)
+        {
+            bin.clear();
+        }
     }
 }
 
@@ -6,13 +6,22 @@
 #define SCREEN_BUFFER_HPP
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
 #include <stdexcept>
+#include <emmintrin.h>
 
 namespace rst
 {
 
-constexpr int SCREEN_WIDTH{1920};
-constexpr int SCREEN_HEIGHT{1080};
+// Used when the presenter does not dictate a resolution
+constexpr int DEFAULT_SCREEN_WIDTH{1920};
+constexpr int DEFAULT_SCREEN_HEIGHT{1080};
+
+constexpr int TILE_SIZE{64};
+
+constexpr int TileCount(int pixels) noexcept { return (pixels + TILE_SIZE - 1) / TILE_SIZE; }
 
 template<typename T>
 class ScreenBuffer
@@ -23,9 +32,14 @@ public:
     ScreenBuffer<T> &operator=(const ScreenBuffer<T> &) = delete;
                     ~ScreenBuffer() noexcept;
 
+    int  GetWidth()  const noexcept { return m_width; }
+    int  GetHeight() const noexcept { return m_height; }
     T    *operator[](std::size_t y) noexcept;
     T    *operator[](std::size_t y) const noexcept;
+    // The whole buffer, bypassing the cache with streaming stores
     void Clear(const T& value);
+    // Rows [y0, y1) of columns [x0, x1), through the cache for the pixels drawn right after
+    void ClearRect(int x0, int y0, int x1, int y1, const T& value) noexcept;
 
     operator const T*() const { return m_memory; }
 private:
@@ -64,12 +78,41 @@ T *ScreenBuffer<T>::operator[](std::size_t y) const noexcept
 template<typename T>
 void ScreenBuffer<T>::Clear(const T &value)
 {
-    for (int y = 0; y < m_height; ++y)
+    std::size_t size = m_width * m_height;
+    if constexpr (sizeof(T) != sizeof(std::uint32_t))
+    {
+        std::fill_n(m_memory, size, value);
+    }
+    else
     {
-        for (int x = 0; x < m_width; ++x)
+        std::uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        __m128i pattern = _mm_set1_epi32(bits);
+
+        // scalar head up to a 16 byte boundary, then whole vectors, then the scalar tail
+        std::size_t i = 0;
+        for (; i < size && reinterpret_cast<std::uintptr_t>(m_memory + i) % sizeof(__m128i) != 0; ++i)
+        {
+            m_memory[i] = value;
+        }
+        for (; i + 4 <= size; i += 4)
         {
-            m_memory[m_width * y + x] = value;
+            _mm_stream_si128(reinterpret_cast<__m128i *>(m_memory + i), pattern);
         }
+        for (; i < size; ++i)
+        {
+            m_memory[i] = value;
+        }
+        _mm_sfence();
+    }
+}
+
+template<typename T>
+void ScreenBuffer<T>::ClearRect(int x0, int y0, int x1, int y1, const T &value) noexcept
+{
+    for (int y = y0; y < y1; ++y)
+    {
+        std::fill((*this)[y] + x0, (*this)[y] + x1, value);
     }
 }
 
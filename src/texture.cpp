@@ -0,0 +1,128 @@
+//
+// PPM loading and mip chain generation.
+//
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include "texture.hpp"
+
+namespace rst
+{
+
+namespace
+{
+
+// Texels of a row or column of a level and their weights
+struct Taps
+{
+    int   first;
+    int   count;
+    float weights[3];
+};
+
+// The footprint of texel i of the next level along an axis, size texels long in the current level and
+// half = max(1, size / 2) in the next one. Even sizes average pairs of texels. The footprints of odd sizes
+// are 2 + 1 / half texels wide, so three texels are weighted and none is dropped or shifted.
+Taps HalvingTaps(int size, int half, int i) noexcept
+{
+    if (size == 1)
+    {
+        return Taps{0, 1, {1.f}};
+    }
+    if (size % 2 == 0)
+    {
+        return Taps{2 * i, 2, {0.5f, 0.5f}};
+    }
+    float inv = 1.f / size;
+    return Taps{2 * i, 3, {(half - i) * inv, half * inv, (i + 1) * inv}};
+}
+
+}
+
+Texture::Level::Level(int width, int height):
+    width{width},
+    height{height},
+    blocksX{(width + BLOCK_SIZE - 1) / BLOCK_SIZE},
+    texels(static_cast<std::size_t>(blocksX) * ((height + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE * BLOCK_SIZE)
+{
+}
+
+Texture::Texture(const std::string &filename):
+    m_filter{TextureFilter::Trilinear}
+{
+    std::ifstream in{filename, std::ios::binary};
+    if (!in.is_open()) throw std::runtime_error("Failed to open " + filename);
+
+    std::string s;
+    if (!(in >> s) || s != "P6") throw std::runtime_error("Failed to parse the magic number");
+
+    int width{0}, height{0};
+    if (!(in >> width >> height) || width <= 0 || height <= 0) throw std::runtime_error("Failed to parse the image size");
+
+    unsigned maxColorValue = 0;
+    if (!(in >> maxColorValue) || maxColorValue == 0 || maxColorValue > 255)
+    {
+        throw std::runtime_error("Failed to parse the max color value");
+    }
+
+    in.unsetf(std::ios_base::skipws);
+    in.ignore(1);
+
+    std::vector<unsigned char> pixels(3ul * width * height);
+    if (!in.read(reinterpret_cast<char *>(pixels.data()), pixels.size()))
+    {
+        throw std::runtime_error("Failed to parse pixels");
+    }
+
+    // rescale to the full 8-bit range, alpha is opaque
+    auto channel = [maxColorValue](unsigned value) { return (value * 255 + maxColorValue / 2) / maxColorValue; };
+    Level base{width, height};
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            auto pixel = &pixels[3 * (static_cast<std::size_t>(width) * y + x)];
+            base.Texel(x, y) = channel(pixel[2]) | channel(pixel[1]) << 8 | channel(pixel[0]) << 16 | 255u << 24;
+        }
+    }
+    m_levels.push_back(std::move(base));
+
+    // every level box-filters the previous one, see HalvingTaps
+    while (m_levels.back().width > 1 || m_levels.back().height > 1)
+    {
+        auto &src = m_levels.back();
+        Level dst{std::max(1, src.width / 2), std::max(1, src.height / 2)};
+        for (int y = 0; y < dst.height; ++y)
+        {
+            Taps ty = HalvingTaps(src.height, dst.height, y);
+            for (int x = 0; x < dst.width; ++x)
+            {
+                Taps tx = HalvingTaps(src.width, dst.width, x);
+                float sum[4]{};
+                for (int j = 0; j < ty.count; ++j)
+                {
+                    for (int i = 0; i < tx.count; ++i)
+                    {
+                        std::uint32_t t = src.Texel(tx.first + i, ty.first + j);
+                        float weight = tx.weights[i] * ty.weights[j];
+                        for (int c = 0; c < 4; ++c)
+                        {
+                            sum[c] += weight * ((t >> 8 * c) & 0xff);
+                        }
+                    }
+                }
+
+                std::uint32_t texel = 0;
+                for (int c = 0; c < 4; ++c)
+                {
+                    texel |= std::min(255u, static_cast<unsigned>(sum[c] + 0.5f)) << 8 * c;
+                }
+                dst.Texel(x, y) = texel;
+            }
+        }
+        m_levels.push_back(std::move(dst));
+    }
+}
+
+}
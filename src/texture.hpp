@@ -5,70 +5,168 @@
 #ifndef TEXTURE_HPP
 #define TEXTURE_HPP
 
-#include <fstream>
 #include <string>
-#include <assert.h>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <emmintrin.h>
 #include "math.hpp"
 #include "aligning_mallocator.hpp"
 
 namespace rst
 {
 
+enum class TextureFilter
+{
+    Nearest,  // nearest texel of the base level
+    Bilinear, // 2x2 texels of the closest mip level
+    Trilinear // bilinear in the two closest mip levels, blended by the fractional LOD
+};
+
+// RGBA texture loaded from a binary PPM. The mip chain is box-filtered down to 1x1 at load time.
+// v = 1 is the top row of the image; coordinates outside [0, 1] wrap around.
+// Texels are packed BGRA8 and stored in 4x4 blocks of one cache line each, Morton-ordered inside
+// the block, so a bilinear footprint touches one or two lines. The sampler unpacks them to floats.
 class Texture
 {
 public:
-    explicit Texture(const std::string &filename);
-    Vec4f    Fetch(const Vec2f &uv);
-public:
-    //AlignedVec<Vec4f, sizeof(Vec4f)> m_buf;
-    std::vector<Vec4f> m_buf;
-    float m_width;
-    float m_height;
+    explicit    Texture(const std::string &filename);
+
+    void        SetFilter(TextureFilter filter)                                 noexcept { m_filter = filter; }
+    std::size_t GetLevelCount()                                           const noexcept { return m_levels.size(); }
+    Vec4f       Fetch(const Vec2f &uv)                                    const noexcept;
+    // Level of detail from the screen-space derivatives of the texture coordinates
+    float       Lod(const Vec2f &ddx, const Vec2f &ddy)                   const noexcept;
+    Vec4f       Sample(const Vec2f &uv, float lod)                        const noexcept;
+    Vec4f       Sample(const Vec2f &uv, const Vec2f &ddx, const Vec2f &ddy) const noexcept;
+private:
+    static constexpr int BLOCK_SIZE{4};
+
+    // a block fills exactly one cache line
+    using Texels = AlignedVec<std::uint32_t, BLOCK_SIZE * BLOCK_SIZE * sizeof(std::uint32_t)>;
+
+    struct Level
+    {
+        int    width;
+        int    height;
+        int    blocksX;
+        Texels texels;
+
+                      Level(int width, int height);
+        std::size_t   Address(int x, int y) const noexcept;
+        std::uint32_t &Texel(int x, int y)        noexcept { return texels[Address(x, y)]; }
+        std::uint32_t Texel(int x, int y)   const noexcept { return texels[Address(x, y)]; }
+    };
+
+    std::vector<Level> m_levels;
+    TextureFilter      m_filter;
+
+    static int    Wrap(int x, int size)                          noexcept;
+    static __m128 Unpack(std::uint32_t texel)                    noexcept;
+    static Vec4f  ToVec(__m128 color)                            noexcept;
+    __m128        Bilinear(const Level &level, const Vec2f &uv) const noexcept;
 };
 
-Texture::Texture(const std::string &filename):
-    m_width{0}, m_height{0}
+inline std::size_t Texture::Level::Address(int x, int y) const noexcept
+{
+    std::size_t block = static_cast<std::size_t>(y / BLOCK_SIZE) * blocksX + x / BLOCK_SIZE;
+    // interleave the two low bits of x and y
+    int morton = (x & 1) | (y & 1) << 1 | (x & 2) << 1 | (y & 2) << 2;
+    return block * BLOCK_SIZE * BLOCK_SIZE + morton;
+}
+
+inline int Texture::Wrap(int x, int size) noexcept
+{
+    x %= size;
+    return x < 0 ? x + size : x;
+}
+
+inline __m128 Texture::Unpack(std::uint32_t texel) noexcept
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i channels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(texel), zero), zero);
+    return _mm_mul_ps(_mm_cvtepi32_ps(channels), _mm_set1_ps(1.f / 255.f));
+}
+
+inline Vec4f Texture::ToVec(__m128 color) noexcept
+{
+    Vec4f result;
+    _mm_storeu_ps(result.data, color);
+    return result;
+}
+
+inline Vec4f Texture::Fetch(const Vec2f &uv) const noexcept
 {
-    std::ifstream in{filename};
-    if (!in.is_open()) throw std::runtime_error("Failed to open " + filename);
+    auto &level = m_levels[0];
+    int x = Wrap(std::lround(uv.x * level.width), level.width);
+    int y = Wrap(std::lround((1 - uv.y) * level.height), level.height);
+    return ToVec(Unpack(level.Texel(x, y)));
+}
+
+inline float Texture::Lod(const Vec2f &ddx, const Vec2f &ddy) const noexcept
+{
+    // squared footprint of a pixel in base level texels
+    auto &base = m_levels[0];
+    Vec2f size{static_cast<float>(base.width), static_cast<float>(base.height)};
+    float rho = std::max(SqrMagnitude(ddx * size), SqrMagnitude(ddy * size));
+    return rho > 0.f ? 0.5f * std::log2(rho) : 0.f;
+}
 
-    std::string s;
-    if (!(in >> s) || s != "P6") throw std::runtime_error("Failed to parse the magic number");
+inline __m128 Texture::Bilinear(const Level &level, const Vec2f &uv) const noexcept
+{
+    // texel centers are at half-integer coordinates
+    float x = uv.x * level.width - 0.5f;
+    float y = (1 - uv.y) * level.height - 0.5f;
+    float fx = std::floor(x);
+    float fy = std::floor(y);
+    __m128 tx = _mm_set1_ps(x - fx);
+    __m128 ty = _mm_set1_ps(y - fy);
 
-    std::size_t width{0}, height{0};
-    if (!(in >> width >> height)) throw std::runtime_error("Failed to parse the image size");
-    m_width = width;
-    m_height = height;
+    int x0 = Wrap(static_cast<int>(fx), level.width);
+    int y0 = Wrap(static_cast<int>(fy), level.height);
+    int x1 = x0 + 1 < level.width ? x0 + 1 : 0;
+    int y1 = y0 + 1 < level.height ? y0 + 1 : 0;
 
-    m_buf.reserve(width * height);
+    // a + t * (b - a)
+    auto lerp = [](__m128 a, __m128 b, __m128 t) { return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a))); };
+    __m128 top = lerp(Unpack(level.Texel(x0, y0)), Unpack(level.Texel(x1, y0)), tx);
+    __m128 bottom = lerp(Unpack(level.Texel(x0, y1)), Unpack(level.Texel(x1, y1)), tx);
+    return lerp(top, bottom, ty);
+}
 
-    unsigned maxColorValue = 0;
-    if (!(in >> maxColorValue) || maxColorValue > 255) throw std::runtime_error("Failed to parse the max color value");
+inline Vec4f Texture::Sample(const Vec2f &uv, float lod) const noexcept
+{
+    if (m_filter == TextureFilter::Nearest)
+    {
+        return Fetch(uv);
+    }
 
-    in.unsetf(std::ios_base::skipws);
-    in.ignore(1);
+    // NaN fails every comparison, so it would pass std::clamp and reach the casts below
+    if (!(lod > 0.f))
+    {
+        lod = 0.f;
+    }
+    lod = std::min(lod, static_cast<float>(m_levels.size() - 1));
+    if (m_filter == TextureFilter::Bilinear)
+    {
+        return ToVec(Bilinear(m_levels[std::lround(lod)], uv));
+    }
 
-    for (auto y = 0ul; y < height; ++y)
+    auto level = static_cast<std::size_t>(lod);
+    float t = lod - level;
+    __m128 color = Bilinear(m_levels[level], uv);
+    if (t > 0.f)
     {
-        for (auto x = 0ul; x < width; ++x)
-        {
-            struct { unsigned char r; unsigned char g; unsigned char b; } pixel{};
-
-            if (!(in.read(reinterpret_cast<char *>(&pixel), 3)))
-            {
-                std::cerr << x << y << "\n";
-                throw std::runtime_error("Failed to parse pixels");
-            }
-            m_buf[width * y + x] = Vec4f(pixel.b, pixel.g, pixel.r, maxColorValue) / maxColorValue;
-        }
+        __m128 next = Bilinear(m_levels[level + 1], uv);
+        color = _mm_add_ps(color, _mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(next, color)));
     }
+    return ToVec(color);
 }
 
-inline Vec4f Texture::Fetch(const Vec2f &uv)
+inline Vec4f Texture::Sample(const Vec2f &uv, const Vec2f &ddx, const Vec2f &ddy) const noexcept
 {
-    std::size_t x = std::lround(uv.x * m_width);
-    std::size_t y = std::lround((1 - uv.y) * m_height);
-    return m_buf[m_width * y + x];
+    return Sample(uv, Lod(ddx, ddy));
 }
 
 }
@@ -3,3 +3,144 @@
 //
 
 #include "thread_pool.hpp"
+
+namespace
+{
+
+thread_local const ThreadPool *currentPool{nullptr};
+thread_local std::size_t      currentWorker{0};
+
+}
+
+ThreadPool::ThreadPool(std::size_t threads):
+    m_threads{threads},
+    m_shouldStop{false},
+    m_pending{0},
+    m_epoch{0},
+    m_sleepers{0}
+{
+    for (std::size_t i = 0; i <= threads; ++i)
+    {
+        m_deques.emplace_back(new Deque{});
+    }
+    for (std::size_t i = 0; i < threads; ++i)
+    {
+        m_workers.emplace_back([this, i] { this->Worker(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_shouldStop = true;
+        ++m_epoch;
+    }
+    m_condition.notify_all();
+    for(auto &worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::EnqueueTask(Task &&task)
+{
+    // workers spawning subtasks push to their own deque, everybody else to the submitter's one
+    auto owner = currentPool == this ? currentWorker : m_threads;
+
+    ++m_pending;
+    m_deques[owner]->Push(new Task{std::move(task)});
+    ++m_epoch;
+
+    if (m_sleepers > 0)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.notify_one();
+    }
+}
+
+void ThreadPool::Wait()
+{
+    for (int i = 0; i < SPIN_COUNT && m_pending > 0; ++i)
+    {
+        std::this_thread::yield();
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_finishCondition.wait(lock, [this] { return m_pending == 0; });
+}
+
+ThreadPool::Task *ThreadPool::FindTask(std::size_t threadId, std::uint32_t &seed) noexcept
+{
+    if (auto task = m_deques[threadId]->Pop())
+    {
+        return task;
+    }
+
+    // start from a random victim and sweep over all the other deques
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    auto victims = m_deques.size();
+    for (std::size_t i = 0, start = seed % victims; i < victims; ++i)
+    {
+        auto victim = (start + i) % victims;
+        if (victim == threadId)
+        {
+            continue;
+        }
+        if (auto task = m_deques[victim]->Steal())
+        {
+            return task;
+        }
+    }
+
+    return nullptr;
+}
+
+void ThreadPool::RunTask(Task *task, std::size_t threadId)
+{
+    (*task)(threadId);
+    delete task;
+
+    if (--m_pending == 0)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_finishCondition.notify_all();
+    }
+}
+
+void ThreadPool::Worker(std::size_t threadId)
+{
+    currentPool = this;
+    currentWorker = threadId;
+    std::uint32_t seed = 2463534242u + threadId;
+
+    for (;;)
+    {
+        std::size_t epoch = m_epoch;
+        Task *task = FindTask(threadId, seed);
+        for (int i = 0; !task && i < SPIN_COUNT; ++i)
+        {
+            std::this_thread::yield();
+            epoch = m_epoch;
+            task = FindTask(threadId, seed);
+        }
+
+        if (task)
+        {
+            RunTask(task, threadId);
+            continue;
+        }
+
+        // nothing to steal: sleep until somebody enqueues a task
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_sleepers;
+        m_condition.wait(lock, [this, epoch] { return m_shouldStop || m_epoch != epoch; });
+        --m_sleepers;
+        if (m_shouldStop && m_pending == 0)
+        {
+            return;
+        }
+    }
+}
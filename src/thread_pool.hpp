@@ -5,91 +5,63 @@
 #ifndef THREAD_POOL_HPP
 #define THREAD_POOL_HPP
 
-#include <queue>
+#include "work_stealing_deque.hpp"
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include <iostream>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <vector>
 
-template<typename Callable>
+// Long-lived work-stealing pool: workers are spawned once and reused by every stage of every frame.
+// Every worker owns a Chase-Lev deque; tasks enqueued from outside the pool go to a separate deque
+// owned by the submitting thread. Idle workers steal from random victims before going to sleep.
+// Only one non-worker thread may submit tasks at a time. Wait() acts as the barrier between stages.
 class ThreadPool
 {
 public:
-    using Params = typename Callable::ThreadParams;
+    using Task = std::function<void(std::size_t threadId)>;
 
-    ThreadPool(std::size_t threads, std::vector<Params> &params);
-    ~ThreadPool();
+    explicit ThreadPool(std::size_t threads);
+             ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+             ~ThreadPool();
 
-    void EnqueueTask(Callable &&task);
-private:
-    std::size_t              m_threads;
-    std::vector<Params>      &m_params;
-    bool                     m_shouldStop;
-    std::vector<std::thread> m_workers;
-    std::queue<Callable>     m_tasks;
-    std::mutex               m_mutex;
-    std::condition_variable  m_condition;
-    std::condition_variable  m_finishCondition;
-    std::size_t              m_jobSetSize;
+    std::size_t GetThreadCount() const noexcept { return m_threads; }
 
-    void Worker(Params &params);
-};
+    void EnqueueTask(Task &&task);
+    template<typename Callable, typename Params>
+    void EnqueueTask(Callable &&task, std::vector<Params> &params);
+    void Wait();
+private:
+    static constexpr int SPIN_COUNT{64};
 
-template<typename Callable>
-ThreadPool<Callable>::ThreadPool(std::size_t threads, std::vector<Params> &params):
-    m_threads{threads},
-    m_params{params},
-    m_shouldStop{false}
-{
-    for (std::size_t i = 0; i < threads; ++i)
-    {
-        m_workers.emplace_back([this, i] { this->Worker(m_params[i]); });
-    }
-}
+    using Deque = WorkStealingDeque<Task>;
 
-template<typename Callable>
-ThreadPool<Callable>::~ThreadPool()
-{
-    {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_shouldStop = true;
-    }
-    m_condition.notify_all();
-    for(auto &worker : m_workers)
-    {
-        worker.join();
-    }
-}
+    std::size_t                         m_threads;
+    std::vector<std::unique_ptr<Deque>> m_deques; // one per worker plus the submitter's
+    std::vector<std::thread>            m_workers;
+    std::atomic<bool>                   m_shouldStop;
+    std::atomic<std::size_t>            m_pending;
+    std::atomic<std::size_t>            m_epoch;
+    std::atomic<std::size_t>            m_sleepers;
+    std::mutex                          m_mutex;
+    std::condition_variable             m_condition;
+    std::condition_variable             m_finishCondition;
 
-template<typename Callable>
-void ThreadPool<Callable>::EnqueueTask(Callable &&task)
-{
-    {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_tasks.emplace(task);
-    }
-    m_condition.notify_one();
-}
+    void Worker(std::size_t threadId);
+    Task *FindTask(std::size_t threadId, std::uint32_t &seed) noexcept;
+    void RunTask(Task *task, std::size_t threadId);
+};
 
-template<typename Callable>
-void ThreadPool<Callable>::Worker(Params &params)
+// Runs a batch task against the per-thread parameters of whichever worker picks it up
+template<typename Callable, typename Params>
+void ThreadPool::EnqueueTask(Callable &&task, std::vector<Params> &params)
 {
-    for (;;)
-    {
-        Callable task;
-        {
-            std::unique_lock<std::mutex> lock(m_mutex);
-            m_condition.wait(lock, [this] { return m_shouldStop || !m_tasks.empty(); });
-            if (m_shouldStop && m_tasks.empty()) {
-                return;
-            }
-
-            task = std::move(m_tasks.front());
-            m_tasks.pop();
-        }
-
-        task(params);
-    }
+    EnqueueTask([task = std::forward<Callable>(task), &params](std::size_t threadId) mutable {
+        task(params[threadId]);
+    });
 }
 
 #endif //THREAD_POOL_HPP
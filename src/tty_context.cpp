@@ -3,61 +3,139 @@
 //
 
 #include "tty_context.hpp"
-#include <fcntl.h>
-#include <unistd.h>
-#include <cstdio>
-#include <cmath>
+#include "presenter.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <string>
 
 namespace rst
 {
 
-TtyContext::TtyContext() noexcept:
-    m_frameBuffer{SCREEN_WIDTH, SCREEN_HEIGHT},
-    m_depthBuffer{SCREEN_WIDTH, SCREEN_HEIGHT}
+TtyContext::TtyContext():
+    TtyContext{MakePresenter("fbdev")}
 {
-    Clear();
 }
 
-void TtyContext::FlushFb() const noexcept
+TtyContext::TtyContext(std::unique_ptr<Presenter> presenter):
+    TtyContext{NativeSize(*presenter), std::move(presenter)}
 {
-    int fd = open("/dev/fb0", O_WRONLY);
-    if (fd < 0)
+}
+
+TtyContext::TtyContext(std::unique_ptr<Presenter> presenter, int width, int height):
+    TtyContext{CheckSize(width, height), std::move(presenter)}
+{
+}
+
+TtyContext::TtyContext(std::pair<int, int> size, std::unique_ptr<Presenter> presenter):
+    m_width{size.first},
+    m_height{size.second},
+    m_viewport{0, 0, size.first, size.second},
+    m_frameBuffers{FrameBuffer(size.first, size.second), FrameBuffer(size.first, size.second)},
+    m_back{0},
+    m_depthBuffer(PadToBlocks(size.first), PadToBlocks(size.second)),
+    m_hizBuffer(PadToBlocks(size.first), PadToBlocks(size.second)),
+    m_tilesX{TileCount(size.first)},
+    m_tilesY{TileCount(size.second)},
+    m_clearPending(m_tilesX * m_tilesY, 0),
+    m_presenter{std::move(presenter)}
+{
+    for (auto &frameBuffer : m_frameBuffers)
     {
-        std::perror("open fb0");
-        return;
+        frameBuffer.Clear(Color{0x0, 0x0, 0x0, 0x0});
     }
+    m_depthBuffer.Clear(1.0f);
+    m_hizBuffer.Clear(1.0f);
+}
+
+std::pair<int, int> TtyContext::NativeSize(const Presenter &presenter)
+{
+    int width = DEFAULT_SCREEN_WIDTH;
+    int height = DEFAULT_SCREEN_HEIGHT;
+    presenter.GetNativeSize(width, height);
+    return CheckSize(width, height);
+}
 
-    if (write(fd, m_frameBuffer, sizeof(Color) * SCREEN_WIDTH * SCREEN_HEIGHT) < 0)
+std::pair<int, int> TtyContext::CheckSize(int width, int height)
+{
+    if (width <= 0 || height <= 0 || width > MAX_TARGET_SIZE || height > MAX_TARGET_SIZE)
     {
-        std::perror("write");
+        throw std::runtime_error("Invalid resolution " + std::to_string(width) + "x" + std::to_string(height));
     }
-    close(fd);
+    return {width, height};
 }
 
-void TtyContext::Clear() noexcept
+TtyContext::~TtyContext() = default;
+
+void TtyContext::SetPresenter(std::unique_ptr<Presenter> presenter) noexcept
 {
-    m_frameBuffer.Clear(Color{0x0, 0x0, 0x0, 0x0});
-    m_depthBuffer.Clear(1.0f);
+    m_presenter = std::move(presenter);
 }
 
-float XScreenToNdc(int x) noexcept
+void TtyContext::SetViewport(const Viewport &viewport)
 {
-    return -1.0f + (2.0f * x + 1.0f) / SCREEN_WIDTH;
+    if (viewport.x < 0 || viewport.y < 0 || viewport.width <= 0 || viewport.height <= 0 ||
+        viewport.x + viewport.width > m_width || viewport.y + viewport.height > m_height)
+    {
+        throw std::runtime_error("Viewport outside the render target");
+    }
+    m_viewport = viewport;
 }
 
-float YScreenToNdc(int y) noexcept
+void TtyContext::FlushFb()
+{
+    ResolveClears();
+    // the presenter may still be reading the previous frame, which is the one rendered next;
+    // Present returns only once it is done with it
+    m_presenter->Present(m_frameBuffers[m_back]);
+    m_back ^= 1;
+}
+
+void TtyContext::Clear() noexcept
 {
-    return -1.0f + (2.0f * y + 1.0f) / SCREEN_HEIGHT;
+    std::fill(m_clearPending.begin(), m_clearPending.end(), 1);
 }
 
-int XNdcToScreen(float x) noexcept
+void TtyContext::ClearTile(int tileX, int tileY) noexcept
 {
-    return std::lround(-0.5f + SCREEN_WIDTH / 2.0f * (x + 1));
+    auto &pending = m_clearPending[m_tilesX * tileY + tileX];
+    if (!pending)
+    {
+        return;
+    }
+    pending = 0;
+
+    int x0 = tileX * TILE_SIZE;
+    int y0 = tileY * TILE_SIZE;
+    GetFrameBuffer().ClearRect(x0, y0, std::min(x0 + TILE_SIZE, m_width), std::min(y0 + TILE_SIZE, m_height),
+                               Color{0x0, 0x0, 0x0, 0x0});
+    // including the padding of the edge tiles
+    m_depthBuffer.ClearRect(x0, y0, std::min(x0 + TILE_SIZE, m_depthBuffer.GetWidth()),
+                            std::min(y0 + TILE_SIZE, m_depthBuffer.GetHeight()), 1.0f);
+
+    int bx0 = x0 / HIZ_BLOCK_SIZE;
+    int by0 = y0 / HIZ_BLOCK_SIZE;
+    int bx1 = std::min((x0 + TILE_SIZE) / HIZ_BLOCK_SIZE, m_hizBuffer.GetMin().GetWidth());
+    int by1 = std::min((y0 + TILE_SIZE) / HIZ_BLOCK_SIZE, m_hizBuffer.GetMin().GetHeight());
+    m_hizBuffer.GetMin().ClearRect(bx0, by0, bx1, by1, 1.0f);
+    m_hizBuffer.GetMax().ClearRect(bx0, by0, bx1, by1, 1.0f);
 }
 
-int YNdcToScreen(float y) noexcept
+void TtyContext::ResolveClears() noexcept
 {
-    return std::lround(-0.5f + SCREEN_HEIGHT / 2.0f * (y + 1));
+    // the tiles stay marked, their depth is still never read
+    for (int tileY = 0; tileY < m_tilesY; ++tileY)
+    {
+        for (int tileX = 0; tileX < m_tilesX; ++tileX)
+        {
+            if (m_clearPending[m_tilesX * tileY + tileX])
+            {
+                int x0 = tileX * TILE_SIZE;
+                int y0 = tileY * TILE_SIZE;
+                GetFrameBuffer().ClearRect(x0, y0, std::min(x0 + TILE_SIZE, m_width),
+                                           std::min(y0 + TILE_SIZE, m_height), Color{0x0, 0x0, 0x0, 0x0});
+            }
+        }
+    }
 }
 
 }
@@ -6,15 +6,17 @@
 #define TTY_CONTEXT_HPP
 
 #include <cstdint>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <vector>
 #include "screen_buffer.hpp"
+#include "hiz_buffer.hpp"
 #include "math.hpp"
-#include "screen_lock.hpp"
 
 namespace rst
 {
 
-constexpr float ASPECT_RATIO{SCREEN_WIDTH * 1.0f / SCREEN_HEIGHT};
-
 struct Color
 {
     std::uint8_t b, g, r, a;
@@ -29,31 +31,80 @@ struct Color
 using FrameBuffer = ScreenBuffer<Color>;
 using DepthBuffer = ScreenBuffer<float>;
 
+// Largest width and height of a render target, bounded by the fixed-point triangle setup (see SetupTriangle)
+constexpr int MAX_TARGET_SIZE{16384};
+
+// Pixel rectangle of the render target the NDC square [-1, 1] x [-1, 1] is mapped to
+struct Viewport
+{
+    int x;
+    int y;
+    int width;
+    int height;
+
+    float GetAspectRatio()         const noexcept { return width * 1.0f / height; }
+    // NDC of a pixel center
+    float XScreenToNdc(int px)     const noexcept { return -1.0f + (2.0f * (px - x) + 1.0f) / width; }
+    float YScreenToNdc(int py)     const noexcept { return -1.0f + (2.0f * (py - y) + 1.0f) / height; }
+    int   XNdcToScreen(float ndcX) const noexcept { return x + std::lround(-0.5f + width / 2.0f * (ndcX + 1)); }
+    int   YNdcToScreen(float ndcY) const noexcept { return y + std::lround(-0.5f + height / 2.0f * (ndcY + 1)); }
+    // Unrounded, pixel centers are at whole numbers
+    float XNdcToPixel(float ndcX)  const noexcept { return x - 0.5f + width / 2.0f * (ndcX + 1); }
+    float YNdcToPixel(float ndcY)  const noexcept { return y - 0.5f + height / 2.0f * (ndcY + 1); }
+};
+
+class Presenter;
+
 class TtyContext
 {
 public:
-                      TtyContext()            noexcept;
-    FrameBuffer       &GetFrameBuffer()       noexcept { return m_frameBuffer; }
-    const FrameBuffer &GetFrameBuffer() const noexcept { return m_frameBuffer; }
+    // Frames go to /dev/fb0 unless another presenter is given. The resolution is the one of the
+    // presenter's device if it has one, the default one otherwise, unless it is given explicitly.
+    // Rendering alternates between two frame buffers: FlushFb hands the current one to the presenter
+    // and switches to the other, so GetFrameBuffer must be called again after every flush.
+                      TtyContext();
+    explicit          TtyContext(std::unique_ptr<Presenter> presenter);
+                      TtyContext(std::unique_ptr<Presenter> presenter, int width, int height);
+                      ~TtyContext();
+    FrameBuffer       &GetFrameBuffer()       noexcept { return m_frameBuffers[m_back]; }
+    const FrameBuffer &GetFrameBuffer() const noexcept { return m_frameBuffers[m_back]; }
     DepthBuffer       &GetDepthBuffer()       noexcept { return m_depthBuffer; }
     const DepthBuffer &GetDepthBuffer() const noexcept { return m_depthBuffer; }
-    ScreenLock        &GetScreenLock()        noexcept { return m_screenLock; }
-    const ScreenLock  &GetScreenLock()  const noexcept { return m_screenLock; }
-
+    HiZBuffer         &GetHiZBuffer()         noexcept { return m_hizBuffer; }
+    const HiZBuffer   &GetHiZBuffer()   const noexcept { return m_hizBuffer; }
+    int               GetWidth()        const noexcept { return m_width; }
+    int               GetHeight()       const noexcept { return m_height; }
+    // The whole render target unless set otherwise
+    const Viewport    &GetViewport()    const noexcept { return m_viewport; }
+    void              SetViewport(const Viewport &viewport);
+    Presenter         &GetPresenter()         noexcept { return *m_presenter; }
+    void              SetPresenter(std::unique_ptr<Presenter> presenter) noexcept;
 
-    void FlushFb() const noexcept;
+    void FlushFb();
+    // Clearing is lazy: Clear only marks every tile, a marked tile is cleared by ClearTile when it is
+    // first drawn into, and the color of the tiles nothing was drawn into is cleared by ResolveClears,
+    // which FlushFb calls before presenting. The depth of a marked tile is undefined.
     void Clear()         noexcept;
+    void ClearTile(int tileX, int tileY) noexcept;
+    void ResolveClears() noexcept;
 
 private:
-    ScreenBuffer<Color> m_frameBuffer;
-    ScreenBuffer<float> m_depthBuffer;
-    ScreenLock          m_screenLock;
-};
+    int                        m_width;
+    int                        m_height;
+    Viewport                   m_viewport;
+    ScreenBuffer<Color>        m_frameBuffers[2];
+    std::size_t                m_back;
+    ScreenBuffer<float>        m_depthBuffer; // padded to whole HiZ blocks
+    HiZBuffer                  m_hizBuffer;
+    int                        m_tilesX;
+    int                        m_tilesY;
+    std::vector<std::uint8_t>  m_clearPending; // per tile, written only by the worker owning the tile
+    std::unique_ptr<Presenter> m_presenter;
 
-float XScreenToNdc(int x)   noexcept;
-float YScreenToNdc(int y)   noexcept;
-int   XNdcToScreen(float x) noexcept;
-int   YNdcToScreen(float y) noexcept;
+    TtyContext(std::pair<int, int> size, std::unique_ptr<Presenter> presenter);
+    static std::pair<int, int> NativeSize(const Presenter &presenter);
+    static std::pair<int, int> CheckSize(int width, int height);
+};
 
 }
 
@@ -0,0 +1,132 @@
+//
+// Lock-free per-worker task deque for ThreadPool.
+//
+
+#ifndef WORK_STEALING_DEQUE_HPP
+#define WORK_STEALING_DEQUE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+// The owner pushes and pops at the bottom, any other thread may steal from the top.
+template<typename T>
+class WorkStealingDeque
+{
+public:
+    explicit WorkStealingDeque(std::size_t capacity = 1024);
+             WorkStealingDeque(const WorkStealingDeque &) = delete;
+    WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+    void Push(T *item);
+    T    *Pop()   noexcept;
+    T    *Steal() noexcept;
+private:
+    struct Array
+    {
+        std::size_t                        mask;
+        std::unique_ptr<std::atomic<T *>[]> items;
+
+        explicit Array(std::size_t capacity):
+            mask{capacity - 1},
+            items{new std::atomic<T *>[capacity]} {}
+
+        std::size_t Capacity() const noexcept { return mask + 1; }
+        T    *Get(std::int64_t i) const noexcept { return items[i & mask].load(std::memory_order_relaxed); }
+        void Put(std::int64_t i, T *item) noexcept { items[i & mask].store(item, std::memory_order_relaxed); }
+    };
+
+    alignas(64) std::atomic<std::int64_t> m_top;
+    alignas(64) std::atomic<std::int64_t> m_bottom;
+    std::atomic<Array *>                  m_array;
+    // grown-out arrays may still be read by a concurrent thief, so they live as long as the deque
+    std::vector<std::unique_ptr<Array>>   m_arrays;
+};
+
+template<typename T>
+WorkStealingDeque<T>::WorkStealingDeque(std::size_t capacity):
+    m_top{0},
+    m_bottom{0}
+{
+    m_arrays.emplace_back(new Array{capacity});
+    m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+}
+
+template<typename T>
+void WorkStealingDeque<T>::Push(T *item)
+{
+    std::int64_t b = m_bottom.load(std::memory_order_relaxed);
+    std::int64_t t = m_top.load(std::memory_order_acquire);
+    Array *a = m_array.load(std::memory_order_relaxed);
+
+    if (b - t > static_cast<std::int64_t>(a->Capacity()) - 1)
+    {
+        auto grown = new Array{a->Capacity() * 2};
+        for (auto i = t; i < b; ++i)
+        {
+            grown->Put(i, a->Get(i));
+        }
+        m_arrays.emplace_back(grown);
+        m_array.store(grown, std::memory_order_release);
+        a = grown;
+    }
+
+    a->Put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+template<typename T>
+T *WorkStealingDeque<T>::Pop() noexcept
+{
+    std::int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+    Array *a = m_array.load(std::memory_order_relaxed);
+    m_bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t t = m_top.load(std::memory_order_relaxed);
+
+    if (t > b)
+    {
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    T *item = a->Get(b);
+    if (t == b)
+    {
+        // last item: race against thieves for it
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            item = nullptr;
+        }
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    return item;
+}
+
+template<typename T>
+T *WorkStealingDeque<T>::Steal() noexcept
+{
+    std::int64_t t = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t b = m_bottom.load(std::memory_order_acquire);
+
+    if (t >= b)
+    {
+        return nullptr;
+    }
+
+    Array *a = m_array.load(std::memory_order_acquire);
+    T *item = a->Get(t);
+    if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+    {
+        return nullptr;
+    }
+
+    return item;
+}
+
+#endif //WORK_STEALING_DEQUE_HPP